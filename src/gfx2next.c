@@ -19,6 +19,7 @@
  *    .nxb - Block
  *    .nxi - Bitmap
  *    .nxm - Map
+ *    .nxc - Map chunk index
  *    .nxp - Palette
  *    .nxt - Tiles
  *    .spr - Sprites
@@ -38,6 +39,16 @@ int _CRT_glob = 0;
 #include <ctype.h>
 #include <math.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "zx0.h"
 #include "lodepng.h"
 
@@ -58,7 +69,7 @@ int _CRT_glob = 0;
 #define NEXT_4BIT_PALETTE_SIZE		32
 
 #define NUM_PALETTE_COLORS			256
-#define MAX_LABEL_COUNT				8
+#define MAX_LABEL_COUNT				NUM_BANKS
 #define MAX_BANK_SECTION_COUNT		8
 
 #define TILES_SIZE					262144 * 256
@@ -94,6 +105,7 @@ int _CRT_glob = 0;
 #define TILED_TILEID_MASK			0x1FFFFFFF
 
 #define DBL_MAX						1.7976931348623158e+308
+#define FLT_MAX						3.402823466e+38F
 
 #define RGB888(r8,g8,b8)			((r8 << 16) | (g8 << 8) | b8)
 #define RGB332(r3,g3,b2)			((r3 << 5) | (g3 << 2) | b2)
@@ -104,6 +116,28 @@ int _CRT_glob = 0;
 #define MIN(x,y)					((x) < (y) ? (x) : (y))
 #define MAX(x,y)					((x) > (y) ? (x) : (y))
 
+#define TILE_FEATURE_COUNT			12
+#define TILE_MERGE_TABLES			8
+#define TILE_MERGE_PROJECTIONS		4
+#define TILE_MERGE_BUCKETS			65536
+#define TILE_HASH_BUCKETS			65536
+#define SCREEN_COLOR_COUNT			15
+#define SCREEN_COLOR_NONE			0xff
+#define TILE_DB_MAGIC				"NXTD"
+#define TILE_DB_VERSION				1
+#define TILE_DB_RECORD_HEADER		8
+#define BLOCK_HASH_BUCKETS			65536
+#define TILE_REDUCE_GRID			4
+#define TILE_REDUCE_FEATURE_COUNT	(TILE_REDUCE_GRID * TILE_REDUCE_GRID * 3)
+#define TILE_REDUCE_ITERATIONS		30
+#define TILE_ORDER_COUNT			4
+#define TILE_ORDER_SIMILARITY_MAX	2048
+
+#define MAP_TRANSFORM_PLANES		(1 << 0)
+#define MAP_TRANSFORM_DELTA			(1 << 1)
+#define MAP_TRANSFORM_RLE			(1 << 2)
+#define MAP_TRANSFORM_COUNT			8
+
 #define EXT_ZX0						".zx0"
 
 #define EXT_BIN						".bin"
@@ -113,11 +147,13 @@ int _CRT_glob = 0;
 #define EXT_SPR						".spr"
 #define EXT_NXB						".nxb"
 #define EXT_NXI						".nxi"
+#define EXT_NXC						".nxc"
 #define EXT_SCR						".scr"
 #define EXT_TMX						".tmx"
 #define EXT_TSX						".tsx"
 
 static uint8_t attributes_to_tiled_flags(uint8_t attributes);
+static uint8_t get_tile_pixel(uint32_t tile_index, uint32_t offset);
 
 uint32_t m_screenColors[] =
 {
@@ -203,6 +239,51 @@ typedef enum
 	COMPRESS_ALL = COMPRESS_SCREEN | COMPRESS_BITMAP | COMPRESS_SPRITES | COMPRESS_TILES | COMPRESS_BLOCKS | COMPRESS_MAP | COMPRESS_PALETTE
 } compress_t;
 
+typedef enum
+{
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON
+} stats_mode_t;
+
+typedef enum
+{
+	STAGE_DECODE,
+	STAGE_PALETTE,
+	STAGE_TILES,
+	STAGE_COMPRESS,
+	STAGE_PREVIEW,
+	STAGE_COUNT
+} stage_t;
+
+typedef struct
+{
+	double stage_ms[STAGE_COUNT];
+	uint64_t tiles_scanned;
+	uint64_t hash_probes;
+	uint64_t compare_calls;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t compress_in;
+	uint64_t compress_out;
+	uint64_t files_written;
+	uint64_t files_unchanged;
+} stats_t;
+
+typedef struct
+{
+	uint8_t magic[4];
+	uint16_t version;
+	uint8_t bits;
+	uint8_t orientations;
+	uint16_t tile_width;
+	uint16_t tile_height;
+	uint32_t tile_count;
+	uint32_t bucket_count;
+	uint32_t index_offset;
+	uint32_t record_size;
+} tile_db_header_t;
+
 typedef struct
 {
 	char *in_filename;
@@ -211,6 +292,9 @@ typedef struct
 	bool font;
 	bool screen;
 	bool screen_attribs;
+	bool screen_bestfit;
+	bool screen_hicolor;
+	bool screen_hires;
 	bool bitmap;
 	bool bitmap_y;
 	bool sprites;
@@ -219,6 +303,11 @@ typedef struct
 	bool tile_norepeat;
 	bool tile_nomirror;
 	bool tile_norotate;
+	int tile_merge;
+	int tile_reduce;
+	bool tile_order;
+	char *tile_shared;
+	char *tile_db;
 	bool tile_y;
 	bool tile_ldws;
 	int tile_offset;
@@ -232,13 +321,18 @@ typedef struct
 	char *tiled_file;
 	int tiled_blank;
 	bool tiled_output;
+	bool tiled_zlib;
 	int tiled_width;
 	bool block_norepeat;
+	bool block_mirror;
 	bool block_16bit;
 	bool map_none;
 	bool map_16bit;
 	bool map_y;
 	bool map_sms;
+	int map_chunk_width;
+	int map_chunk_height;
+	bool map_transform;
 	bank_size_t bank_size;
 	color_mode_t color_mode;
 	bool colors_4bit;
@@ -255,6 +349,10 @@ typedef struct
 	int pal_zx_default;
 	bool zx0_back;
 	bool zx0_quick;
+	bool zx0_auto;
+	bool zx0_verify;
+	bool bank_pack;
+	int threads;
 	compress_t compress;
 	asm_mode_t asm_mode;
 	char *asm_file;
@@ -264,6 +362,8 @@ typedef struct
 	bool asm_end_auto;
 	bool asm_sequence;
 	bool preview;
+	bool preview_fast;
+	stats_mode_t stats;
 } arguments_t;
 
 static arguments_t m_args  =
@@ -274,6 +374,9 @@ static arguments_t m_args  =
 	.font = false,
 	.screen = false,
 	.screen_attribs = false,
+	.screen_bestfit = false,
+	.screen_hicolor = false,
+	.screen_hires = false,
 	.bitmap = false,
 	.bitmap_y = false,
 	.sprites = false,
@@ -282,6 +385,11 @@ static arguments_t m_args  =
 	.tile_norepeat = false,
 	.tile_nomirror = false,
 	.tile_norotate = false,
+	.tile_merge = -1,
+	.tile_reduce = -1,
+	.tile_order = false,
+	.tile_shared = NULL,
+	.tile_db = NULL,
 	.tile_y = false,
 	.tile_ldws = false,
 	.tile_offset = 0,
@@ -295,13 +403,18 @@ static arguments_t m_args  =
 	.tiled_file = NULL,
 	.tiled_blank = 0,
 	.tiled_output = false,
+	.tiled_zlib = false,
 	.tiled_width = 256,
 	.block_norepeat = false,
+	.block_mirror = false,
 	.block_16bit = false,
 	.map_none = false,
 	.map_16bit = false,
 	.map_y = false,
 	.map_sms = false,
+	.map_chunk_width = 0,
+	.map_chunk_height = 0,
+	.map_transform = false,
 	.bank_size = BANKSIZE_NONE,
 	.color_mode = COLORMODE_DISTANCE,
 	.colors_4bit = false,
@@ -318,6 +431,10 @@ static arguments_t m_args  =
 	.pal_zx_default = -1,
 	.zx0_back = false,
 	.zx0_quick = false,
+	.zx0_auto = false,
+	.zx0_verify = false,
+	.bank_pack = false,
+	.threads = 0,
 	.compress = COMPRESS_NONE,
 	.asm_mode = ASMMODE_NONE,
 	.asm_file = NULL,
@@ -327,6 +444,8 @@ static arguments_t m_args  =
 	.asm_end_auto = false,
 	.asm_sequence = false,
 	.preview = false,
+	.preview_fast = false,
+	.stats = STATS_NONE,
 };
 
 static uint8_t m_bmp_header[BMP_HEADER_SIZE] = { 0 };
@@ -336,11 +455,18 @@ static uint8_t m_min_palette[PALETTE_SIZE] = { 0 };
 static uint16_t m_next_palette[NEXT_PALETTE_SIZE / 2] = { 0 };
 
 static uint8_t m_min_palette_index[NUM_PALETTE_COLORS] = { 0 };
+static uint8_t m_screen_color_index[NUM_PALETTE_COLORS] = { 0 };
+static uint32_t m_screen_color_distance[SCREEN_COLOR_COUNT][SCREEN_COLOR_COUNT] = { { 0 } };
 static uint8_t m_std_palette_index[NUM_PALETTE_COLORS] = { 0 };
 
 static uint8_t m_tiles[TILES_SIZE] = { 0 };
 static uint16_t m_map[MAP_SIZE] = { 0 };
+static uint32_t m_map_tiles[MAP_SIZE] = { 0 };
 static uint16_t m_blocks[BLOCK_SIZE] = { 0 };
+static uint8_t m_block_attributes[BLOCK_SIZE] = { 0 };
+static int32_t m_block_hash[BLOCK_HASH_BUCKETS];
+static int32_t m_block_next[BLOCK_SIZE];
+static bool m_block_hash_init = false;
 
 static uint8_t *m_image = NULL;
 static uint32_t m_image_width = 0;
@@ -378,12 +504,64 @@ static uint32_t m_block_count = 0;
 
 static uint32_t m_chunk_size = 0;
 
+static int32_t m_tile_hash_head[TILE_HASH_BUCKETS];
+static int32_t m_tile_hash_tail[TILE_HASH_BUCKETS];
+static int32_t *m_tile_hash_next = NULL;
+static uint32_t *m_tile_hash_keys = NULL;
+static uint32_t m_tile_hash_capacity = 0;
+static uint32_t m_tile_hash_count = 0;
+static bool m_tile_hash_init = false;
+static bool m_tile_shared_write = true;
+static uint32_t m_tile_db_count = 0;
+static uint8_t m_tile_db_orientations = 0;
+static uint32_t m_tile_db_index_offset = 0;
+
+static float m_palette_distance[NUM_PALETTE_COLORS][NUM_PALETTE_COLORS] = { { 0 } };
+static float m_merge_projections[TILE_MERGE_TABLES][TILE_MERGE_PROJECTIONS][TILE_FEATURE_COUNT + 1] = { { { 0 } } };
+static float m_merge_width = 0.0f;
+static uint32_t m_merge_buckets[TILE_MERGE_TABLES][TILE_MERGE_BUCKETS] = { { 0 } };
+static float *m_merge_features = NULL;
+static uint32_t *m_merge_next = NULL;
+static uint32_t *m_merge_stamp = NULL;
+static uint32_t m_merge_stamp_value = 0;
+static uint32_t m_merge_capacity = 0;
+static uint32_t m_merge_count = 0;
+static double m_merge_error = 0.0;
+static float m_merge_max_error = 0.0f;
+
 static char m_bitmap_filename[256] = { 0 };
 static char m_asm_labels[MAX_LABEL_COUNT][256] = { { 0 } };
 
-static FILE *m_bitmap_file = NULL;
-static FILE *m_asm_file = NULL;
-static FILE *m_header_file = NULL;
+typedef struct output_s
+{
+	char filename[256];
+	uint8_t *p_data;
+	size_t size;
+	size_t capacity;
+	struct output_s *p_next;
+} output_t;
+
+static output_t *m_bitmap_file = NULL;
+static output_t *m_asm_file = NULL;
+static output_t *m_header_file = NULL;
+
+static output_t *m_output_head = NULL;
+static output_t *m_output_tail = NULL;
+static pthread_t m_output_thread;
+static pthread_mutex_t m_output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_output_cond = PTHREAD_COND_INITIALIZER;
+static bool m_output_started = false;
+static bool m_output_busy = false;
+static bool m_output_stop = false;
+static char m_output_error[300] = { 0 };
+static mode_t m_output_mode = 0666;
+static bool m_exit_failure = false;
+
+static void close_output(output_t *p_output);
+static void stop_outputs(void);
+
+static const char *m_stage_names[STAGE_COUNT] = { "decode", "palette", "tiles", "compress", "preview" };
+static stats_t m_stats = { { 0 } };
 
 static void close_all(void)
 {
@@ -401,19 +579,19 @@ static void close_all(void)
 	
 	if (m_bitmap_file != NULL)
 	{
-		fclose(m_bitmap_file);
+		close_output(m_bitmap_file);
 		m_bitmap_file = NULL;
 	}
 	
 	if (m_asm_file != NULL)
 	{
-		fclose(m_asm_file);
+		close_output(m_asm_file);
 		m_asm_file = NULL;
 	}
 	
 	if (m_header_file != NULL)
 	{
-		fclose(m_header_file);
+		close_output(m_header_file);
 		m_header_file = NULL;
 	}
 }
@@ -421,6 +599,7 @@ static void close_all(void)
 static void exit_handler(void)
 {
 	close_all();
+	stop_outputs();
 }
 
 static void exit_with_msg(const char *format, ...)
@@ -429,10 +608,480 @@ static void exit_with_msg(const char *format, ...)
 	va_start(args, format);
 	vfprintf(stderr, format, args);
 	va_end(args);
+	
+	// Outputs still open are incomplete, the exit handler drops them.
+	m_exit_failure = true;
 
 	exit(EXIT_FAILURE);
 }
 
+static double get_time_ms(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void stats_end(stage_t stage, double start_ms)
+{
+	m_stats.stage_ms[stage] += get_time_ms() - start_ms;
+}
+
+typedef void (*parallel_func_t)(void *p_data, int index);
+
+typedef struct
+{
+	parallel_func_t p_func;
+	void *p_data;
+	int count;
+	int next;
+	pthread_mutex_t mutex;
+} parallel_t;
+
+static int get_thread_count(void)
+{
+	if (m_args.threads > 0)
+		return m_args.threads;
+	
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return (int) MAX(MIN(cpu_count, 64), 1);
+}
+
+static void *parallel_worker(void *p_arg)
+{
+	parallel_t *p_parallel = (parallel_t *)p_arg;
+	
+	while (true)
+	{
+		pthread_mutex_lock(&p_parallel->mutex);
+		int index = p_parallel->next++;
+		pthread_mutex_unlock(&p_parallel->mutex);
+		
+		if (index >= p_parallel->count)
+			break;
+		
+		p_parallel->p_func(p_parallel->p_data, index);
+	}
+	
+	return NULL;
+}
+
+static void run_parallel(parallel_func_t p_func, void *p_data, int count)
+{
+	// Calls p_func(p_data, i) for i in [0, count) on up to -threads threads,
+	// the calling thread included. Returns when all calls are done.
+	int thread_count = MIN(get_thread_count(), count);
+	parallel_t parallel = { p_func, p_data, count, 0 };
+	pthread_t threads[64];
+	int started = 0;
+	
+	pthread_mutex_init(&parallel.mutex, NULL);
+	
+	for (int i = 1; i < thread_count; i++)
+	{
+		if (pthread_create(&threads[started], NULL, parallel_worker, &parallel) == 0)
+			started++;
+	}
+	
+	parallel_worker(&parallel);
+	
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	
+	pthread_mutex_destroy(&parallel.mutex);
+}
+
+static bool is_output_unchanged(output_t *p_output)
+{
+	// Compares size first and then the contents in blocks, stopping at the first difference.
+	struct stat file_stat;
+	uint8_t buffer[16384];
+	size_t offset = 0;
+	
+	if (stat(p_output->filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || (size_t)file_stat.st_size != p_output->size)
+		return false;
+	
+	FILE *p_file = fopen(p_output->filename, "rb");
+	
+	if (p_file == NULL)
+		return false;
+	
+	while (offset < p_output->size)
+	{
+		size_t count = fread(buffer, sizeof(uint8_t), MIN(sizeof(buffer), p_output->size - offset), p_file);
+		
+		if (count == 0 || memcmp(buffer, p_output->p_data + offset, count) != 0)
+			break;
+		
+		offset += count;
+	}
+	
+	fclose(p_file);
+	
+	return offset == p_output->size;
+}
+
+static bool write_output_file(output_t *p_output, bool *p_unchanged, char *p_error, size_t error_size)
+{
+	// Data goes to a unique <name>.XXXXXX in the same directory first so a reader
+	// never sees a partly written file and two runs never share a temporary file,
+	// and an output with the same bytes as the file on disk is not touched at all.
+	char temp_filename[272] = { 0 };
+	bool ok = false;
+	
+	*p_unchanged = is_output_unchanged(p_output);
+	
+	if (*p_unchanged)
+	{
+		free(p_output->p_data);
+		free(p_output);
+		
+		return true;
+	}
+	
+	snprintf(temp_filename, sizeof(temp_filename), "%s.XXXXXX", p_output->filename);
+	
+	int fd = mkstemp(temp_filename);
+	FILE *p_file = NULL;
+	
+	// mkstemp() creates the file as 0600, new outputs get the usual umask mode.
+	if (fd >= 0 && (fchmod(fd, m_output_mode) != 0 || (p_file = fdopen(fd, "wb")) == NULL))
+	{
+		close(fd);
+		remove(temp_filename);
+	}
+	
+	if (p_file == NULL)
+	{
+		snprintf(p_error, error_size, "Can't create file %s.\n", p_output->filename);
+	}
+	else
+	{
+		size_t written = (p_output->size > 0 ? fwrite(p_output->p_data, sizeof(uint8_t), p_output->size, p_file) : 0);
+		
+		if (fclose(p_file) != 0 || written != p_output->size)
+		{
+			snprintf(p_error, error_size, "Error writing file %s.\n", p_output->filename);
+		}
+		else if (rename(temp_filename, p_output->filename) != 0)
+		{
+			snprintf(p_error, error_size, "Can't create file %s.\n", p_output->filename);
+		}
+		else
+		{
+			ok = true;
+		}
+		
+		if (!ok)
+		{
+			remove(temp_filename);
+		}
+	}
+	
+	free(p_output->p_data);
+	free(p_output);
+	
+	return ok;
+}
+
+static void *output_worker(void *p_arg)
+{
+	pthread_mutex_lock(&m_output_mutex);
+	
+	while (true)
+	{
+		while (m_output_head == NULL && !m_output_stop)
+			pthread_cond_wait(&m_output_cond, &m_output_mutex);
+		
+		if (m_output_head == NULL)
+			break;
+		
+		output_t *p_output = m_output_head;
+		char error[sizeof(m_output_error)] = { 0 };
+		
+		m_output_head = p_output->p_next;
+		
+		if (m_output_head == NULL)
+			m_output_tail = NULL;
+		
+		m_output_busy = true;
+		pthread_mutex_unlock(&m_output_mutex);
+		
+		bool unchanged = false;
+		bool ok = write_output_file(p_output, &unchanged, error, sizeof(error));
+		
+		pthread_mutex_lock(&m_output_mutex);
+		
+		if (!ok && m_output_error[0] == 0)
+			strcpy(m_output_error, error);
+		
+		if (ok && unchanged)
+			m_stats.files_unchanged++;
+		else if (ok)
+			m_stats.files_written++;
+		
+		m_output_busy = false;
+		pthread_cond_broadcast(&m_output_cond);
+	}
+	
+	pthread_mutex_unlock(&m_output_mutex);
+	
+	return NULL;
+}
+
+static void check_outputs(void)
+{
+	pthread_mutex_lock(&m_output_mutex);
+	
+	char error[sizeof(m_output_error)];
+	strcpy(error, m_output_error);
+	
+	pthread_mutex_unlock(&m_output_mutex);
+	
+	if (error[0] != 0)
+	{
+		exit_with_msg("%s", error);
+	}
+}
+
+static void flush_outputs(void)
+{
+	// Returns when every closed output is on disk.
+	pthread_mutex_lock(&m_output_mutex);
+	
+	while (m_output_head != NULL || m_output_busy)
+		pthread_cond_wait(&m_output_cond, &m_output_mutex);
+	
+	pthread_mutex_unlock(&m_output_mutex);
+}
+
+static void stop_outputs(void)
+{
+	if (!m_output_started)
+		return;
+	
+	pthread_mutex_lock(&m_output_mutex);
+	m_output_stop = true;
+	pthread_cond_broadcast(&m_output_cond);
+	pthread_mutex_unlock(&m_output_mutex);
+	
+	pthread_join(m_output_thread, NULL);
+	
+	m_output_started = false;
+	m_output_stop = false;
+}
+
+static output_t *open_output(const char *p_filename, bool append)
+{
+	// Outputs are built in memory and written by the output thread on close_output().
+	output_t *p_output = calloc(1, sizeof(output_t));
+	
+	if (p_output == NULL)
+	{
+		exit_with_msg("Can't create file %s.\n", p_filename);
+	}
+	
+	strncpy(p_output->filename, p_filename, sizeof(p_output->filename) - 1);
+	
+	if (append)
+	{
+		// A previous output of this file may still be queued.
+		flush_outputs();
+		
+		FILE *p_file = fopen(p_filename, "rb");
+		
+		if (p_file != NULL)
+		{
+			fseek(p_file, 0, SEEK_END);
+			p_output->capacity = p_output->size = ftell(p_file);
+			p_output->p_data = malloc(p_output->capacity + 1);
+			fseek(p_file, 0, SEEK_SET);
+			
+			if (p_output->p_data == NULL || fread(p_output->p_data, sizeof(uint8_t), p_output->size, p_file) != p_output->size)
+			{
+				exit_with_msg("Can't read file %s.\n", p_filename);
+			}
+			
+			fclose(p_file);
+		}
+	}
+	
+	return p_output;
+}
+
+static uint8_t *reserve_output(output_t *p_output, size_t size)
+{
+	if (p_output->size + size > p_output->capacity)
+	{
+		size_t capacity = MAX(p_output->capacity * 2, 4096);
+		
+		while (capacity < p_output->size + size)
+			capacity *= 2;
+		
+		uint8_t *p_data = realloc(p_output->p_data, capacity);
+		
+		if (p_data == NULL)
+		{
+			exit_with_msg("Can't allocate memory for file %s.\n", p_output->filename);
+		}
+		
+		p_output->p_data = p_data;
+		p_output->capacity = capacity;
+	}
+	
+	return p_output->p_data + p_output->size;
+}
+
+static void write_output(output_t *p_output, const void *p_data, size_t size)
+{
+	memcpy(reserve_output(p_output, size), p_data, size);
+	
+	p_output->size += size;
+}
+
+static void print_output(output_t *p_output, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	
+	char *p_text = (char *)reserve_output(p_output, length + 1);
+	
+	va_start(args, format);
+	vsnprintf(p_text, length + 1, format, args);
+	va_end(args);
+	
+	p_output->size += length;
+}
+
+static void close_output(output_t *p_output)
+{
+	// Hands the buffer over to the output thread, started on first use. After a
+	// failure the output is dropped so the previous file stays as it was.
+	if (m_exit_failure)
+	{
+		free(p_output->p_data);
+		free(p_output);
+		
+		return;
+	}
+	
+	check_outputs();
+	
+	pthread_mutex_lock(&m_output_mutex);
+	
+	if (!m_output_started)
+	{
+		// umask() can only be read by setting it, so it is read before the output thread creates any files.
+		mode_t mask = umask(0);
+		
+		umask(mask);
+		m_output_mode = 0666 & ~mask;
+		
+		m_output_started = (pthread_create(&m_output_thread, NULL, output_worker, NULL) == 0);
+	}
+	
+	if (!m_output_started)
+	{
+		pthread_mutex_unlock(&m_output_mutex);
+		
+		char error[sizeof(m_output_error)] = { 0 };
+		bool unchanged = false;
+		
+		if (!write_output_file(p_output, &unchanged, error, sizeof(error)))
+		{
+			exit_with_msg("%s", error);
+		}
+		
+		if (unchanged)
+			m_stats.files_unchanged++;
+		else
+			m_stats.files_written++;
+		
+		return;
+	}
+	
+	if (m_output_tail != NULL)
+		m_output_tail->p_next = p_output;
+	else
+		m_output_head = p_output;
+	
+	m_output_tail = p_output;
+	
+	pthread_cond_broadcast(&m_output_cond);
+	pthread_mutex_unlock(&m_output_mutex);
+}
+
+static uint64_t get_peak_rss(void)
+{
+	struct rusage usage;
+	
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	
+#ifdef __APPLE__
+	// ru_maxrss is in bytes on macOS and kilobytes elsewhere
+	return usage.ru_maxrss;
+#else
+	return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+static uint32_t get_file_size(const char *filename)
+{
+	FILE *in_file = fopen(filename, "rb");
+	
+	if (in_file == NULL)
+		return 0;
+	
+	fseek(in_file, 0, SEEK_END);
+	uint32_t file_size = ftell(in_file);
+	fclose(in_file);
+	
+	return file_size;
+}
+
+static void print_stats(double total_ms)
+{
+	double ratio = (m_stats.compress_in > 0 ? (double) m_stats.compress_out / m_stats.compress_in : 0.0);
+	uint64_t peak_rss = get_peak_rss();
+	
+	if (m_args.stats == STATS_JSON)
+	{
+		printf("{\"version\": \"%s\", \"total_ms\": %.3f, \"stages\": {", VERSION, total_ms);
+		
+		for (int i = 0; i < STAGE_COUNT; i++)
+			printf("%s\"%s_ms\": %.3f", i == 0 ? "" : ", ", m_stage_names[i], m_stats.stage_ms[i]);
+		
+		printf("}, \"tiles_scanned\": %llu, \"hash_probes\": %llu, \"compare_calls\": %llu", (unsigned long long) m_stats.tiles_scanned, (unsigned long long) m_stats.hash_probes, (unsigned long long) m_stats.compare_calls);
+		printf(", \"bytes_in\": %llu, \"bytes_out\": %llu", (unsigned long long) m_stats.bytes_in, (unsigned long long) m_stats.bytes_out);
+		printf(", \"compress_in\": %llu, \"compress_out\": %llu, \"compress_ratio\": %.4f", (unsigned long long) m_stats.compress_in, (unsigned long long) m_stats.compress_out, ratio);
+		printf(", \"files_written\": %llu, \"files_unchanged\": %llu", (unsigned long long) m_stats.files_written, (unsigned long long) m_stats.files_unchanged);
+		printf(", \"peak_rss\": %llu}\n", (unsigned long long) peak_rss);
+	}
+	else
+	{
+		printf("Stats:\n");
+		
+		for (int i = 0; i < STAGE_COUNT; i++)
+			printf("  %-14s = %10.3f ms\n", m_stage_names[i], m_stats.stage_ms[i]);
+		
+		printf("  %-14s = %10.3f ms\n", "total", total_ms);
+		printf("  %-14s = %llu\n", "tiles scanned", (unsigned long long) m_stats.tiles_scanned);
+		printf("  %-14s = %llu\n", "hash probes", (unsigned long long) m_stats.hash_probes);
+		printf("  %-14s = %llu\n", "compare calls", (unsigned long long) m_stats.compare_calls);
+		printf("  %-14s = %llu bytes\n", "bytes in", (unsigned long long) m_stats.bytes_in);
+		printf("  %-14s = %llu bytes\n", "bytes out", (unsigned long long) m_stats.bytes_out);
+		printf("  %-14s = %llu -> %llu bytes (%.2f%%)\n", "compression", (unsigned long long) m_stats.compress_in, (unsigned long long) m_stats.compress_out, ratio * 100.0);
+		printf("  %-14s = %llu written, %llu unchanged\n", "files", (unsigned long long) m_stats.files_written, (unsigned long long) m_stats.files_unchanged);
+		printf("  %-14s = %llu KB\n", "peak rss", (unsigned long long) (peak_rss / 1024));
+	}
+}
+
 static uint8_t c8_to_c4(uint8_t c8, color_mode_t color_mode)
 {
 	double c4 = (c8 * 15.0) / 255.0;
@@ -564,49 +1213,7 @@ static uint16_t rgb888_to_rgb444(uint32_t rgb888, color_mode_t color_mode)
 	return RGB444(r4, g4, b4);
 }
 
-static uint8_t get_screen_color_attribs(uint32_t rgb888, bool useInk)
-{
-	int index = 0;
-	
-	for (; index < 15; index++)
-	{
-		if (rgb888 == m_screenColors[index])
-			break;
-	}
-	
-	return (useInk ? m_screenAttribsInk[index] : m_screenAttribsPaper[index]);
-}
-
-static uint32_t get_nearest_screen_color(uint32_t rgb888)
-{
-	uint32_t match = 0;
-	double min_dist = DBL_MAX;
-	uint8_t r = rgb888 >> 16;
-	uint8_t g = rgb888 >> 8;
-	uint8_t b = rgb888;
-	
-	for (int i = 0; i < 15; i++)
-	{
-		uint32_t rgb888_pal = m_screenColors[i];
-		uint8_t rp = rgb888_pal >> 16;
-		uint8_t gp = rgb888_pal >> 8;
-		uint8_t bp = rgb888_pal;
-		double dist = sqrt(pow(rp - r, 2) + pow(gp - g, 2) + pow(bp - b, 2));
-
-		if (dist < min_dist)
-		{
-			match = rgb888_pal;
-			min_dist = dist;
-
-			if (dist == 0)
-				return rgb888_pal;
-		}
-	}
-	
-	return match;
-}
-
-static uint32_t get_nearest_color(uint32_t rgb888, bool use_333)
+static uint32_t get_nearest_color(uint32_t rgb888, bool use_333)
 {
 	uint32_t match = 0;
 	double min_dist = DBL_MAX;
@@ -871,6 +1478,9 @@ static void print_usage(void)
 	printf("  -font                   Sets output to Next font format (.spr)\n");
 	printf("  -screen                 Sets output to Spectrum screen format (.scr)\n");
 	printf("  -screen-noattribs       Remove color attributes\n");
+	printf("  -screen-hicolor         Sets output to Timex hi-colour screen format with 8x1 attributes\n");
+	printf("  -screen-hires           Sets output to Timex hi-res screen format (512x192)\n");
+	printf("  -screen-bestfit         Use the two colors with the least error for attribute blocks with more than 2 colors\n");
 	printf("  -bitmap                 Sets output to Next bitmap mode (.nxi)\n");
 	printf("  -bitmap-y               Get bitmap in Y order first. (Default is X order first)\n");
 	printf("  -bitmap-size=XxY        Splits up the bitmap output file into X x Y sections\n");
@@ -881,6 +1491,12 @@ static void print_usage(void)
 	printf("  -tile-norepeat          Remove repeating tiles\n");
 	printf("  -tile-nomirror          Remove repeating and mirrored tiles\n");
 	printf("  -tile-norotate          Remove repeating, rotating and mirrored tiles\n");
+	printf("  -tile-merge=n           Merge near-duplicate tiles with a mean pixel color distance <= n\n");
+	printf("  -tile-reduce            Reduce the tile count to 256 (512 for -map-16bit) by merging similar tiles\n");
+	printf("  -tile-reduce=n          Reduce the tile count to n by merging similar tiles\n");
+	printf("  -tile-order             Renumber the tiles in the order that compresses the tiles and map best\n");
+	printf("  -tile-db=<filename>     Load tiles from and save new tiles to an indexed tileset database\n");
+	printf("  -tile-shared=<filename> Share one tileset between wildcard files and save it as <filename>.nxt\n");
 	printf("  -tile-y                 Get tile in Y order first. (Default is X order first)\n");
 	printf("  -tile-ldws              Get tile in Y order first for ldws instruction. (Default is X order first)\n");
 	printf("  -tile-offset=n          Sets the starting tile offset to n tiles\n");
@@ -895,17 +1511,22 @@ static void print_usage(void)
 	printf("  -tiled-blank=n          Set the tile id of the blank tile\n");
 	printf("  -tiled-output           Outputs tile and map data to Tiled .tmx and .tsx format\n");
 	printf("  -tiled-width=n          Sets Tiled tileset width output in pixels (default is 256)\n");
+	printf("  -tiled-zlib             Write Tiled layer data as base64 encoded zlib instead of csv\n");
 	printf("  -block-size=XxY         Sets blocks size to X x Y for blocks of tiles\n");
 	printf("  -block-size=n           Sets blocks size to n bytes for blocks of tiles\n");
 	printf("  -block-norepeat         Remove repeating blocks\n");
+	printf("  -block-mirror           Remove repeating blocks that are mirrored (sets -block-norepeat and -map-16bit)\n");
 	printf("  -block-16bit            Get blocks as 16 bit index for < 256 blocks\n");
 	printf("  -map-none               Don't save a map file\n");
 	printf("  -map-16bit              Save map as 16 bit output\n");
 	printf("  -map-y                  Save map in Y order first. (Default is X order first)\n");
+	printf("  -map-transform          Pick the smallest of byte plane split, row delta and RLE for the map, tagged in its first byte\n");
+	printf("  -map-chunk=WxH          Split the map into WxH tile chunks that never cross a bank, with a .nxc chunk index\n");
 	printf("  -map-sms                Save 16-bit map with Sega Master System attribute format\n");
 	printf("  -bank-8k                Splits up output file into multiple 8k files\n");
 	printf("  -bank-16k               Splits up output file into multiple 16k files\n");
 	printf("  -bank-48k               Splits up output file into multiple 48k files\n");
+	printf("  -bank-pack              Fill each bank with as much zx0 compressed tile/sprite data as fits\n");
 	printf("  -bank-sections=name,... Section names for asm files\n");
 	printf("  -color-distance         Use the shortest distance between color values (default)\n");
 	printf("  -color-floor            Round down the color values to the nearest integer\n");
@@ -939,6 +1560,9 @@ static void print_usage(void)
 	printf("  -zx0-palette            Compress palette data using zx0\n");
 	printf("  -zx0-back               Set zx0 to reverse compression mode\n");
 	printf("  -zx0-quick              Set zx0 to quick compression mode\n");
+	printf("  -zx0-auto               Compress each file forwards and backwards and keep the smallest\n");
+	printf("  -zx0-verify             Decompress all zx0 data and check it matches the input\n");
+	printf("  -threads=n              Number of threads used for parallel work (default is the number of CPUs)\n");
 	printf("  -asm-z80asm             Generate header and asm binary include files (in Z80ASM format)\n");
 	printf("  -asm-sjasm              Generate asm binary incbin file (SjASM format)\n");
 	printf("  -asm-file=<name>        Append asm and header output to <name>.asm and <name>.h\n");
@@ -948,6 +1572,9 @@ static void print_usage(void)
 	printf("  -asm-end-auto           Sets end parameter for first item when using wildcards\n");
 	printf("  -asm-sequence           Add sequence section for multi-bank spanning data\n");
 	printf("  -preview                Generate png preview file(s)\n");
+	printf("  -preview-fast           Generate png preview file(s) uncompressed for speed (sets -preview)\n");
+	printf("  -stats                  Output stage timings and counters\n");
+	printf("  -stats=json             Output stage timings and counters as json\n");
 }
 
 static bool parse_args(int argc, char *argv[], arguments_t *args)
@@ -980,6 +1607,22 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.screen_attribs = true;
 			}
+			else if (!strcmp(argv[i], "-screen-hicolor"))
+			{
+				m_args.screen = true;
+				m_args.screen_hicolor = true;
+				m_args.pal_mode = PALMODE_NONE;
+			}
+			else if (!strcmp(argv[i], "-screen-hires"))
+			{
+				m_args.screen = true;
+				m_args.screen_hires = true;
+				m_args.pal_mode = PALMODE_NONE;
+			}
+			else if (!strcmp(argv[i], "-screen-bestfit"))
+			{
+				m_args.screen_bestfit = true;
+			}
 			else if (!strcmp(argv[i], "-bitmap"))
 			{
 				m_args.bitmap = true;
@@ -1040,6 +1683,38 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.tile_norotate = true;
 			}
+			else if (!strncmp(argv[i], "-tile-merge=", 12))
+			{
+				m_args.tile_merge = atoi(&argv[i][12]);
+				
+				printf("Tile Merge = %d\n", m_args.tile_merge);
+			}
+			else if (!strcmp(argv[i], "-tile-reduce"))
+			{
+				m_args.tile_reduce = 0;
+			}
+			else if (!strncmp(argv[i], "-tile-reduce=", 13))
+			{
+				m_args.tile_reduce = atoi(&argv[i][13]);
+				
+				printf("Tile Reduce = %d\n", m_args.tile_reduce);
+			}
+			else if (!strcmp(argv[i], "-tile-order"))
+			{
+				m_args.tile_order = true;
+			}
+			else if (!strncmp(argv[i], "-tile-db=", 9))
+			{
+				m_args.tile_db = &argv[i][9];
+				
+				printf("Tile Database = %s\n", m_args.tile_db);
+			}
+			else if (!strncmp(argv[i], "-tile-shared=", 13))
+			{
+				m_args.tile_shared = &argv[i][13];
+				
+				printf("Tile Shared = %s\n", m_args.tile_shared);
+			}
 			else if (!strcmp(argv[i], "-tile-y"))
 			{
 				m_args.tile_y = true;
@@ -1095,6 +1770,10 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.tiled_output = true;
 			}
+			else if (!strcmp(argv[i], "-tiled-zlib"))
+			{
+				m_args.tiled_zlib = true;
+			}
 			else if (!strncmp(argv[i], "-tiled-width=", 13))
 			{
 				m_args.tiled_width = atoi(&argv[i][13]);
@@ -1113,6 +1792,12 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.block_norepeat = true;
 			}
+			else if (!strcmp(argv[i], "-block-mirror"))
+			{
+				m_args.block_norepeat = true;
+				m_args.block_mirror = true;
+				m_args.map_16bit = true;
+			}
 			else if (!strcmp(argv[i], "-block-16bit"))
 			{
 				m_args.block_16bit = true;
@@ -1129,6 +1814,22 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.map_y = true;
 			}
+			else if (!strncmp(argv[i], "-map-chunk=", 11))
+			{
+				m_args.map_chunk_width = atoi(strtok(&argv[i][11], "x"));
+				m_args.map_chunk_height = atoi(strtok(NULL, "x"));
+				
+				if (m_args.map_chunk_width <= 0 || m_args.map_chunk_height <= 0)
+				{
+					exit_with_msg("Invalid map chunk size %s.\n", argv[i]);
+				}
+				
+				printf("Map Chunk Size = %d x %d\n", m_args.map_chunk_width, m_args.map_chunk_height);
+			}
+			else if (!strcmp(argv[i], "-map-transform"))
+			{
+				m_args.map_transform = true;
+			}
 			else if (!strcmp(argv[i], "-map-sms"))
 			{
 				m_args.map_sms = true;
@@ -1159,6 +1860,10 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 				m_bank_size = atoi(&argv[i][11]);
 				printf("Bank Size = %d\n", m_bank_size);
 			}
+			else if (!strcmp(argv[i], "-bank-pack"))
+			{
+				m_args.bank_pack = true;
+			}
 			else if (!strncmp(argv[i], "-bank-sections=", 15))
 			{
 				char *token = strtok(&argv[i][15], ",");
@@ -1299,6 +2004,20 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.zx0_quick = true;
 			}
+			else if (!strcmp(argv[i], "-zx0-auto"))
+			{
+				m_args.zx0_auto = true;
+			}
+			else if (!strcmp(argv[i], "-zx0-verify"))
+			{
+				m_args.zx0_verify = true;
+			}
+			else if (!strncmp(argv[i], "-threads=", 9))
+			{
+				m_args.threads = atoi(&argv[i][9]);
+				
+				printf("Threads = %d\n", m_args.threads);
+			}
 			else if (!strcmp(argv[i], "-asm-z80asm") || !strcmp(argv[i], "-z80asm"))
 			{
 				m_args.asm_mode = ASMMODE_Z80ASM;
@@ -1335,6 +2054,19 @@ static bool parse_args(int argc, char *argv[], arguments_t *args)
 			{
 				m_args.preview = true;
 			}
+			else if (!strcmp(argv[i], "-preview-fast"))
+			{
+				m_args.preview = true;
+				m_args.preview_fast = true;
+			}
+			else if (!strcmp(argv[i], "-stats"))
+			{
+				m_args.stats = STATS_TEXT;
+			}
+			else if (!strcmp(argv[i], "-stats=json"))
+			{
+				m_args.stats = STATS_JSON;
+			}
 			else if (!strcmp(argv[i], "-help"))
 			{
 				print_usage();
@@ -1759,16 +2491,30 @@ static void read_png()
 	free(image);
 }
 
-static void write_png_bits(const char *in_filename, uint8_t *p_image, int width, int height, bool is_4bit)
+typedef struct
 {
+	char filename[256];
+	uint8_t *p_image;
+	int width;
+	int height;
+	bool is_4bit;
+	unsigned char *p_png;
+	size_t png_size;
 	unsigned error;
-	unsigned char *image = NULL;
-	size_t outsize;
+} png_job_t;
+
+static png_job_t *m_png_queue = NULL;
+static int m_png_queue_count = 0;
+static int m_png_queue_capacity = 0;
+static bool m_png_queue_active = false;
+
+static void encode_png(png_job_t *p_job)
+{
 	LodePNGState state;
 	
 	lodepng_state_init(&state);
 	
-	uint32_t num_palette_colors = (is_4bit ? 16 : 256);
+	uint32_t num_palette_colors = (p_job->is_4bit ? 16 : 256);
 	
 	for (int i = 0; i < num_palette_colors; i++)
 	{
@@ -1782,27 +2528,118 @@ static void write_png_bits(const char *in_filename, uint8_t *p_image, int width,
 	}
 	
 	state.info_png.color.colortype = LCT_PALETTE;
-	state.info_png.color.bitdepth = (is_4bit ? 4 : 8);
+	state.info_png.color.bitdepth = (p_job->is_4bit ? 4 : 8);
 	state.info_raw.colortype = LCT_PALETTE;
-	state.info_raw.bitdepth = (is_4bit ? 4 : 8);
+	state.info_raw.bitdepth = (p_job->is_4bit ? 4 : 8);
 	state.encoder.auto_convert = 0;
 	
-	error = lodepng_encode(&image, &outsize, p_image, width, height, &state);
+	if (m_args.preview_fast)
+	{
+		// No filtering and stored deflate blocks, the file is about the raw image size.
+		state.encoder.filter_palette_zero = 0;
+		state.encoder.filter_strategy = LFS_ZERO;
+		state.encoder.zlibsettings.btype = 0;
+	}
 	
-	if (error)
+	p_job->error = lodepng_encode(&p_job->p_png, &p_job->png_size, p_job->p_image, p_job->width, p_job->height, &state);
+	
+	lodepng_state_cleanup(&state);
+}
+
+static void save_png(png_job_t *p_job)
+{
+	if (p_job->error)
 	{
-		exit_with_msg("Can't write the Png image data in file %s (error %u: %s).\n", in_filename, error, lodepng_error_text(error));
+		exit_with_msg("Can't write the Png image data in file %s (error %u: %s).\n", p_job->filename, p_job->error, lodepng_error_text(p_job->error));
 	}
 	
-	error = lodepng_save_file(image, outsize, in_filename);
+	// The encoded png is handed over to the output thread as is.
+	output_t *p_output = open_output(p_job->filename, false);
 	
-	if (error)
+	p_output->p_data = p_job->p_png;
+	p_output->size = p_output->capacity = p_job->png_size;
+	
+	close_output(p_output);
+	
+	m_stats.bytes_out += p_job->png_size;
+}
+
+static void png_queue_job(void *p_arg, int index)
+{
+	encode_png(&((png_job_t *)p_arg)[index]);
+}
+
+static void begin_png_queue(void)
+{
+	// Previews written until end_png_queue() are encoded together on -threads threads.
+	m_png_queue_active = true;
+	m_png_queue_count = 0;
+}
+
+static void end_png_queue(void)
+{
+	double start_ms = get_time_ms();
+	
+	run_parallel(png_queue_job, m_png_queue, m_png_queue_count);
+	
+	// Files are saved in queue order so the output does not depend on the thread count.
+	for (int i = 0; i < m_png_queue_count; i++)
 	{
-		exit_with_msg("Can't write the Png image data in file %s (error %u: %s).\n", in_filename, error, lodepng_error_text(error));
+		save_png(&m_png_queue[i]);
+		
+		free(m_png_queue[i].p_image);
 	}
 	
-	lodepng_state_cleanup(&state);
-	free(image);
+	free(m_png_queue);
+	
+	m_png_queue = NULL;
+	m_png_queue_count = 0;
+	m_png_queue_capacity = 0;
+	m_png_queue_active = false;
+	
+	stats_end(STAGE_PREVIEW, start_ms);
+}
+
+static void write_png_bits(const char *in_filename, uint8_t *p_image, int width, int height, bool is_4bit)
+{
+	double start_ms = get_time_ms();
+	png_job_t job = { { 0 } };
+	
+	strncpy(job.filename, in_filename, sizeof(job.filename) - 1);
+	job.p_image = p_image;
+	job.width = width;
+	job.height = height;
+	job.is_4bit = is_4bit;
+	
+	if (m_png_queue_active)
+	{
+		// The caller may reuse its buffer, so queued images are copied.
+		size_t image_size = ((size_t)width * height * (is_4bit ? 4 : 8) + 7) / 8;
+		
+		if (m_png_queue_count == m_png_queue_capacity)
+		{
+			m_png_queue_capacity = (m_png_queue_capacity ? m_png_queue_capacity * 2 : 16);
+			m_png_queue = realloc(m_png_queue, m_png_queue_capacity * sizeof(png_job_t));
+		}
+		
+		job.p_image = malloc(image_size);
+		
+		if (m_png_queue == NULL || job.p_image == NULL)
+		{
+			exit_with_msg("Can't allocate memory for png file %s.\n", in_filename);
+		}
+		
+		memcpy(job.p_image, p_image, image_size);
+		
+		m_png_queue[m_png_queue_count++] = job;
+		
+		return;
+	}
+	
+	encode_png(&job);
+	save_png(&job);
+	
+	stats_end(STAGE_PREVIEW, start_ms);
 }
 
 static void write_png(const char *in_filename, uint8_t *p_image, int width, int height)
@@ -1863,6 +2700,8 @@ static void write_tiles_png(char *png_filename, uint32_t tile_width, uint32_t ti
 	}
 	
 	write_png_bits(png_filename, p_image, *bitmap_width, *bitmap_height, false);
+	
+	free(p_image);
 }
 
 static void process_palette()
@@ -1926,6 +2765,73 @@ static void process_palette()
 	}
 }
 
+static void transpose_block_8x8(uint8_t *p_dst, int dst_stride, const uint8_t *p_src, int src_stride)
+{
+#ifdef __SSE2__
+	// Interleave bytes, words and dwords of the eight rows so each 64-bit
+	// half ends up holding one column.
+	__m128i r0 = _mm_loadl_epi64((const __m128i *)(p_src + 0 * src_stride));
+	__m128i r1 = _mm_loadl_epi64((const __m128i *)(p_src + 1 * src_stride));
+	__m128i r2 = _mm_loadl_epi64((const __m128i *)(p_src + 2 * src_stride));
+	__m128i r3 = _mm_loadl_epi64((const __m128i *)(p_src + 3 * src_stride));
+	__m128i r4 = _mm_loadl_epi64((const __m128i *)(p_src + 4 * src_stride));
+	__m128i r5 = _mm_loadl_epi64((const __m128i *)(p_src + 5 * src_stride));
+	__m128i r6 = _mm_loadl_epi64((const __m128i *)(p_src + 6 * src_stride));
+	__m128i r7 = _mm_loadl_epi64((const __m128i *)(p_src + 7 * src_stride));
+	__m128i a0 = _mm_unpacklo_epi8(r0, r1);
+	__m128i a1 = _mm_unpacklo_epi8(r2, r3);
+	__m128i a2 = _mm_unpacklo_epi8(r4, r5);
+	__m128i a3 = _mm_unpacklo_epi8(r6, r7);
+	__m128i b0 = _mm_unpacklo_epi16(a0, a1);
+	__m128i b1 = _mm_unpackhi_epi16(a0, a1);
+	__m128i b2 = _mm_unpacklo_epi16(a2, a3);
+	__m128i b3 = _mm_unpackhi_epi16(a2, a3);
+	__m128i c[4] = { _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2), _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3) };
+	
+	for (int i = 0; i < 4; i++)
+	{
+		_mm_storel_epi64((__m128i *)(p_dst + (i * 2) * dst_stride), c[i]);
+		_mm_storel_epi64((__m128i *)(p_dst + (i * 2 + 1) * dst_stride), _mm_unpackhi_epi64(c[i], c[i]));
+	}
+#else
+	for (int x = 0; x < 8; x++)
+	{
+		for (int y = 0; y < 8; y++)
+		{
+			p_dst[x * dst_stride + y] = p_src[y * src_stride + x];
+		}
+	}
+#endif
+}
+
+static void transpose_bitmap(uint8_t *p_dst, uint32_t dst_stride, const uint8_t *p_src, int src_stride, uint32_t width, uint32_t height)
+{
+	// Column-major copy, p_dst[x * dst_stride + y] = p_src[y * src_stride + x],
+	// in 8x8 blocks so both sides are accessed a cache line at a time.
+	uint32_t block_width = width & ~7;
+	uint32_t block_height = height & ~7;
+	
+	for (uint32_t y = 0; y < block_height; y += 8)
+	{
+		const uint8_t *p_row = p_src + (ptrdiff_t)y * src_stride;
+		
+		for (uint32_t x = 0; x < block_width; x += 8)
+		{
+			transpose_block_8x8(&p_dst[x * dst_stride + y], dst_stride, &p_row[x], src_stride);
+		}
+	}
+	
+	for (uint32_t y = 0; y < height; y++)
+	{
+		const uint8_t *p_row = p_src + (ptrdiff_t)y * src_stride;
+		
+		for (uint32_t x = (y < block_height ? block_width : 0); x < width; x++)
+		{
+			p_dst[x * dst_stride + y] = p_row[x];
+		}
+	}
+}
+
 static void read_next_image()
 {
 	uint8_t *p_image = m_image;
@@ -1967,29 +2873,35 @@ static void read_next_image()
 		{
 			if (m_args.colors_4bit)
 			{
-				// 640 x 256 layer 2 mode
+				// 640 x 256 layer 2 mode, pack the pixel pairs row by row then transpose.
+				uint8_t *p_packed = malloc(m_next_image_width * m_image_height);
+				
+				if (p_packed == NULL)
+				{
+					exit_with_msg("Can't allocate memory for raw image data.\n");
+				}
+				
 				for (int y = 0; y < m_image_height; y++)
 				{
 					for (int x = 0; x < m_image_width; x += 2)
 					{
 						uint8_t left_pixel = (p_image[x] & 0x0F) << 4;
 						uint8_t right_pixel = p_image[x + 1] & 0x0F;
-						m_next_image[y + (x / 2) * m_image_height] = left_pixel | right_pixel;
+						p_packed[y * m_next_image_width + x / 2] = left_pixel | right_pixel;
 					}
 					p_image = m_bottom_to_top_image ? p_image - m_padded_image_width : p_image + m_padded_image_width;
 				}
+				
+				transpose_bitmap(m_next_image, m_image_height, p_packed, m_next_image_width, m_next_image_width, m_image_height);
+				
+				free(p_packed);
 			}
 			else
 			{
 				// 320 x 256 layer 2 mode
-				for (int y = 0; y < m_image_height; y++)
-				{
-					for (int x = 0; x < m_image_width; x++)
-					{
-						m_next_image[y + x * m_image_height] = p_image[x];
-					}
-					p_image = m_bottom_to_top_image ? p_image - m_padded_image_width : p_image + m_padded_image_width;
-				}
+				int src_stride = m_bottom_to_top_image ? -(int)m_padded_image_width : (int)m_padded_image_width;
+				
+				transpose_bitmap(m_next_image, m_image_height, p_image, src_stride, m_image_width, m_image_height);
 			}
 		}
 		else // Row layout
@@ -2037,7 +2949,7 @@ static void write_asm_header()
 {
 	if (m_args.asm_mode == ASMMODE_SJASM)
 	{
-		fprintf(m_asm_file, "\tdevice zxspectrum48\n");
+		print_output(m_asm_file, "\tdevice zxspectrum48\n");
 	}
 	else if (m_args.asm_mode == ASMMODE_Z80ASM)
 	{
@@ -2053,14 +2965,14 @@ static void write_asm_file(char *p_filename, uint32_t data_size)
 	if (m_args.asm_mode == ASMMODE_SJASM)
 	{
 		if (m_bank_section_index < m_bank_section_count)
-			fprintf(m_asm_file, "\norg %s\n", m_bank_sections[m_bank_section_index++]);
+			print_output(m_asm_file, "\norg %s\n", m_bank_sections[m_bank_section_index++]);
 		else
-			fprintf(m_asm_file, "\norg $c000\n");
-		fprintf(m_asm_file, "\nEXPORT %s\n", label);
-		fprintf(m_asm_file, "EXPORT %s_end\n", label);
-		fprintf(m_asm_file, "\n%s\n", label);
-		fprintf(m_asm_file, "\n\tincbin \"binary/%s\"\t; %d bytes\n", p_filename, data_size);
-		fprintf(m_asm_file, "\n%s_end\n", label);
+			print_output(m_asm_file, "\norg $c000\n");
+		print_output(m_asm_file, "\nEXPORT %s\n", label);
+		print_output(m_asm_file, "EXPORT %s_end\n", label);
+		print_output(m_asm_file, "\n%s\n", label);
+		print_output(m_asm_file, "\n\tincbin \"binary/%s\"\t; %d bytes\n", p_filename, data_size);
+		print_output(m_asm_file, "\n%s_end\n", label);
 	}
 	else if (m_args.asm_mode == ASMMODE_Z80ASM)
 	{
@@ -2073,13 +2985,13 @@ static void write_asm_file(char *p_filename, uint32_t data_size)
 				m_bank_used[m_bank_index] += data_size;
 			}
 			
-			fprintf(m_asm_file, "\nSECTION %s\n", m_bank_sections[m_bank_section_index++]);
+			print_output(m_asm_file, "\nSECTION %s\n", m_bank_sections[m_bank_section_index++]);
 		}
 		else
 		{
 			if (m_bank_index == 0)
 			{
-				fprintf(m_asm_file, "\nSECTION rodata_user\n");
+				print_output(m_asm_file, "\nSECTION rodata_user\n");
 			}
 			else
 			{
@@ -2090,15 +3002,51 @@ static void write_asm_file(char *p_filename, uint32_t data_size)
 				
 				m_bank_used[m_bank_index] += data_size;
 				
-				fprintf(m_asm_file, "\nSECTION BANK_%d\n", m_bank_index);
+				print_output(m_asm_file, "\nSECTION BANK_%d\n", m_bank_index);
 			}
 		}
 		
-		fprintf(m_asm_file, "\nPUBLIC _%s\n", label);
-		fprintf(m_asm_file, "PUBLIC _%s_end\n", label);
-		fprintf(m_asm_file, "\n_%s:\n", label);
-		fprintf(m_asm_file, "\n\tBINARY \"binary/%s\"\t; %d bytes\n", p_filename, data_size);
-		fprintf(m_asm_file, "\n_%s_end:\n", label);
+		print_output(m_asm_file, "\nPUBLIC _%s\n", label);
+		print_output(m_asm_file, "PUBLIC _%s_end\n", label);
+		print_output(m_asm_file, "\n_%s:\n", label);
+		print_output(m_asm_file, "\n\tBINARY \"binary/%s\"\t; %d bytes\n", p_filename, data_size);
+		print_output(m_asm_file, "\n_%s_end:\n", label);
+	}
+}
+
+static void write_asm_zx0_mode(char *p_filename, bool backwards_mode)
+{
+	char label[256] = { 0 };
+	strcpy(label, p_filename);
+	alphanumeric_to_underscore(label);
+	
+	if (m_args.asm_mode == ASMMODE_SJASM)
+	{
+		print_output(m_asm_file, "\nEXPORT %s_zx0_back\n", label);
+		print_output(m_asm_file, "%s_zx0_back EQU %d\n", label, backwards_mode);
+	}
+	else if (m_args.asm_mode == ASMMODE_Z80ASM)
+	{
+		print_output(m_asm_file, "\nPUBLIC _%s_zx0_back\n", label);
+		print_output(m_asm_file, "DEFC _%s_zx0_back = %d\n", label, backwards_mode);
+	}
+}
+
+static void write_asm_timex_mode(char *p_filename, uint8_t port_value)
+{
+	char label[256] = { 0 };
+	strcpy(label, p_filename);
+	alphanumeric_to_underscore(label);
+	
+	if (m_args.asm_mode == ASMMODE_SJASM)
+	{
+		print_output(m_asm_file, "\nEXPORT %s_port_ff\n", label);
+		print_output(m_asm_file, "%s_port_ff EQU %d\n", label, port_value);
+	}
+	else if (m_args.asm_mode == ASMMODE_Z80ASM)
+	{
+		print_output(m_asm_file, "\nPUBLIC _%s_port_ff\n", label);
+		print_output(m_asm_file, "DEFC _%s_port_ff = %d\n", label, port_value);
 	}
 }
 
@@ -2110,37 +3058,37 @@ static void write_asm_sequence()
 	if (m_args.asm_mode == ASMMODE_SJASM)
 	{
 		if (m_bank_section_index < m_bank_section_count)
-			fprintf(m_asm_file, "\norg %s\n", m_bank_sections[m_bank_section_index++]);
+			print_output(m_asm_file, "\norg %s\n", m_bank_sections[m_bank_section_index++]);
 		else
-			fprintf(m_asm_file, "\norg $c000\n");
-		fprintf(m_asm_file, "\nEXPORT %s\n", sequence_filename);
-		fprintf(m_asm_file, "\n%s\n", sequence_filename);
-		fprintf(m_asm_file, "\tdw ");
+			print_output(m_asm_file, "\norg $c000\n");
+		print_output(m_asm_file, "\nEXPORT %s\n", sequence_filename);
+		print_output(m_asm_file, "\n%s\n", sequence_filename);
+		print_output(m_asm_file, "\tdw ");
 		
 		for (int i = 0; i < m_bank_count; i++)
 		{
-			fprintf(m_asm_file, "%s", m_asm_labels[i]);
+			print_output(m_asm_file, "%s", m_asm_labels[i]);
 			
 			if (i < m_bank_count-1)
-				fprintf(m_asm_file, ",");
+				print_output(m_asm_file, ",");
 		}
 	}
 	else if (m_args.asm_mode == ASMMODE_Z80ASM)
 	{
 		if (m_bank_section_index < m_bank_section_count)
-			fprintf(m_asm_file, "\nSECTION %s\n", m_bank_sections[m_bank_section_index++]);
+			print_output(m_asm_file, "\nSECTION %s\n", m_bank_sections[m_bank_section_index++]);
 		else
-			fprintf(m_asm_file, "\nSECTION rodata_user\n");
-		fprintf(m_asm_file, "\nPUBLIC _%s\n", sequence_filename);
-		fprintf(m_asm_file, "\n_%s:\n", sequence_filename);
-		fprintf(m_asm_file, "\tDEFW ");
+			print_output(m_asm_file, "\nSECTION rodata_user\n");
+		print_output(m_asm_file, "\nPUBLIC _%s\n", sequence_filename);
+		print_output(m_asm_file, "\n_%s:\n", sequence_filename);
+		print_output(m_asm_file, "\tDEFW ");
 		
 		for (int i = 0; i < m_bank_count; i++)
 		{
-			fprintf(m_asm_file, "_%s", m_asm_labels[i]);
+			print_output(m_asm_file, "_%s", m_asm_labels[i]);
 			
 			if (i < m_bank_count-1)
-				fprintf(m_asm_file, ",");
+				print_output(m_asm_file, ",");
 		}
 	}
 }
@@ -2149,8 +3097,22 @@ static void write_header_file(char *p_filename, bool type_16bit)
 {
 	alphanumeric_to_underscore(p_filename);
 	
-	fprintf(m_header_file, "extern %s %s[];\n", type_16bit ? "uint16_t" : "uint8_t", p_filename);
-	fprintf(m_header_file, "extern uint8_t *%s_end;\n", p_filename);
+	print_output(m_header_file, "extern %s %s[];\n", type_16bit ? "uint16_t" : "uint8_t", p_filename);
+	print_output(m_header_file, "extern uint8_t *%s_end;\n", p_filename);
+}
+
+static void write_header_zx0_mode(char *p_filename, bool backwards_mode)
+{
+	alphanumeric_to_underscore(p_filename);
+	
+	print_output(m_header_file, "#define %s_zx0_back %d\n", p_filename, backwards_mode);
+}
+
+static void write_header_timex_mode(char *p_filename, uint8_t port_value)
+{
+	alphanumeric_to_underscore(p_filename);
+	
+	print_output(m_header_file, "#define %s_port_ff %d\n", p_filename, port_value);
 }
 
 static void write_header_header(char *p_filename)
@@ -2161,13 +3123,13 @@ static void write_header_header(char *p_filename)
 	to_upper(header_filename);
 	alphanumeric_to_underscore(header_filename);
 
-	fprintf(m_header_file, "#ifndef _%s\n", header_filename);
-	fprintf(m_header_file, "#define _%s\n\n", header_filename);
+	print_output(m_header_file, "#ifndef _%s\n", header_filename);
+	print_output(m_header_file, "#define _%s\n\n", header_filename);
 }
 
 static void write_header_footer()
 {
-	fprintf(m_header_file, "\n#endif\n");
+	print_output(m_header_file, "\n#endif\n");
 }
 
 static void write_header_sequence()
@@ -2175,7 +3137,7 @@ static void write_header_sequence()
 	char header_filename[256] = { 0 };
 	create_filename(header_filename, m_args.out_filename, "_sequence", false);
 	
-	fprintf(m_header_file, "extern uint8_t *%s;\n", header_filename);
+	print_output(m_header_file, "extern uint8_t *%s;\n", header_filename);
 }
 
 static void read_file(char *p_filename, uint8_t *p_buffer, uint32_t buffer_size)
@@ -2193,64 +3155,149 @@ static void read_file(char *p_filename, uint8_t *p_buffer, uint32_t buffer_size)
 	fclose(in_file);
 }
 
-static void write_file(FILE *p_file, char *p_filename, uint8_t *p_buffer, uint32_t buffer_size, bool type_16bit, bool use_compression)
+static void verify_compression(char *p_filename, uint8_t *p_buffer, uint32_t buffer_size, uint8_t *compressed_buffer, size_t compressed_size, bool backwards_mode)
 {
-	if (use_compression)
+	uint8_t *decompressed_buffer = malloc(buffer_size);
+	
+	if (decompressed_buffer == NULL)
 	{
-		size_t compressed_size = 0;
-		
-		uint8_t *compressed_buffer = zx0_compress(p_buffer, buffer_size, m_args.zx0_quick, m_args.zx0_back, &compressed_size);
-
-		if (m_args.asm_mode > ASMMODE_NONE)
-		{
-			write_asm_file(p_filename, compressed_size);
-			
-			if (m_args.asm_mode == ASMMODE_Z80ASM)
-			{
-				write_header_file(p_filename, false);
-			}
-		}
-		
-		// Write the compressed data to file.
-		if (fwrite(compressed_buffer, sizeof(uint8_t), compressed_size, p_file) != compressed_size)
-		{
-			exit_with_msg("Error writing file %s.\n", p_filename);
-		}
-		
-		free(compressed_buffer);
+		exit_with_msg("Can't allocate memory for zx0 verification.\n");
 	}
-	else
+	
+	size_t decompressed_size = zx0_decompress(compressed_buffer, compressed_size, decompressed_buffer, buffer_size, backwards_mode);
+	
+	if (decompressed_size != buffer_size || memcmp(decompressed_buffer, p_buffer, buffer_size))
 	{
-		if (m_args.asm_mode > ASMMODE_NONE)
-		{
-			write_asm_file(p_filename, buffer_size);
-			
-			if (m_args.asm_mode == ASMMODE_Z80ASM)
-			{
-				write_header_file(p_filename, type_16bit);
-			}
-		}
-		
-		// Write the data to file.
-		if (fwrite(p_buffer, sizeof(uint8_t), buffer_size, p_file) != buffer_size)
-		{
-			exit_with_msg("Error writing file %s.\n", p_filename);
-		}
+		exit_with_msg("zx0 verification failed for file %s.\n", p_filename);
 	}
+	
+	free(decompressed_buffer);
 }
 
-static void write_next_palette()
+typedef struct
 {
-	// Write the raw palette either prepended to the raw image file or as a separate file.
-	uint32_t next_palette_size = m_args.colors_4bit && !m_args.pal_full ? NEXT_4BIT_PALETTE_SIZE : NEXT_PALETTE_SIZE;
+	uint8_t *p_buffer;
+	uint32_t buffer_size;
+	uint8_t *compressed_buffers[2];
+	size_t compressed_sizes[2];
+} compress_job_t;
 
-	// 8-bit palette is half the regular palette size
-	if (m_args.pal_rgb332 || m_args.pal_bgr222)
-	{
-		next_palette_size /= 2;
-	}
+static void compress_job(void *p_arg, int index)
+{
+	compress_job_t *p_job = (compress_job_t *)p_arg;
+	
+	zx0_set_progress(false);
+	
+	p_job->compressed_buffers[index] = zx0_compress(p_job->p_buffer, p_job->buffer_size, m_args.zx0_quick, index == 1, &p_job->compressed_sizes[index]);
+	
+	zx0_set_progress(true);
+}
 
-	if (m_args.pal_mode == PALMODE_EMBEDDED)
+static uint8_t *compress_buffer(uint8_t *p_buffer, uint32_t buffer_size, size_t *p_compressed_size, bool *p_backwards_mode)
+{
+	if (!m_args.zx0_auto)
+	{
+		return zx0_compress(p_buffer, buffer_size, m_args.zx0_quick, *p_backwards_mode, p_compressed_size);
+	}
+	
+	// Forwards and backwards on separate threads, keep the smaller (forwards on a tie).
+	compress_job_t job = { p_buffer, buffer_size };
+	
+	run_parallel(compress_job, &job, 2);
+	
+	int best = (job.compressed_sizes[1] < job.compressed_sizes[0] ? 1 : 0);
+	
+	free(job.compressed_buffers[1 - best]);
+	
+	*p_compressed_size = job.compressed_sizes[best];
+	*p_backwards_mode = (best == 1);
+	
+	return job.compressed_buffers[best];
+}
+
+static void write_compressed_file(output_t *p_file, char *p_filename, uint8_t *p_buffer, uint32_t buffer_size, uint8_t *compressed_buffer, size_t compressed_size, bool backwards_mode)
+{
+	// Writes (and frees) the zx0 compressed copy of p_buffer.
+	if (m_args.zx0_verify)
+	{
+		verify_compression(p_filename, p_buffer, buffer_size, compressed_buffer, compressed_size, backwards_mode);
+	}
+	
+	m_stats.compress_in += buffer_size;
+	m_stats.compress_out += compressed_size;
+	m_stats.bytes_out += compressed_size;
+
+	if (m_args.asm_mode > ASMMODE_NONE)
+	{
+		write_asm_file(p_filename, compressed_size);
+		
+		if (m_args.zx0_auto)
+		{
+			write_asm_zx0_mode(p_filename, backwards_mode);
+		}
+		
+		if (m_args.asm_mode == ASMMODE_Z80ASM)
+		{
+			write_header_file(p_filename, false);
+			
+			if (m_args.zx0_auto)
+			{
+				write_header_zx0_mode(p_filename, backwards_mode);
+			}
+		}
+	}
+	
+	// Write the compressed data to file.
+	write_output(p_file, compressed_buffer, compressed_size);
+	
+	free(compressed_buffer);
+}
+
+static void write_file(output_t *p_file, char *p_filename, uint8_t *p_buffer, uint32_t buffer_size, bool type_16bit, bool use_compression)
+{
+	if (use_compression)
+	{
+		size_t compressed_size = 0;
+		bool backwards_mode = m_args.zx0_back;
+		double start_ms = get_time_ms();
+		
+		uint8_t *compressed_buffer = compress_buffer(p_buffer, buffer_size, &compressed_size, &backwards_mode);
+		
+		stats_end(STAGE_COMPRESS, start_ms);
+		
+		write_compressed_file(p_file, p_filename, p_buffer, buffer_size, compressed_buffer, compressed_size, backwards_mode);
+	}
+	else
+	{
+		if (m_args.asm_mode > ASMMODE_NONE)
+		{
+			write_asm_file(p_filename, buffer_size);
+			
+			if (m_args.asm_mode == ASMMODE_Z80ASM)
+			{
+				write_header_file(p_filename, type_16bit);
+			}
+		}
+		
+		// Write the data to file.
+		write_output(p_file, p_buffer, buffer_size);
+		
+		m_stats.bytes_out += buffer_size;
+	}
+}
+
+static void write_next_palette()
+{
+	// Write the raw palette either prepended to the raw image file or as a separate file.
+	uint32_t next_palette_size = m_args.colors_4bit && !m_args.pal_full ? NEXT_4BIT_PALETTE_SIZE : NEXT_PALETTE_SIZE;
+
+	// 8-bit palette is half the regular palette size
+	if (m_args.pal_rgb332 || m_args.pal_bgr222)
+	{
+		next_palette_size /= 2;
+	}
+
+	if (m_args.pal_mode == PALMODE_EMBEDDED)
 	{
 		write_file(m_bitmap_file, m_bitmap_filename, (uint8_t *)m_next_palette, next_palette_size, false, m_args.compress & COMPRESS_PALETTE);
 	}
@@ -2260,20 +3307,15 @@ static void write_next_palette()
 		
 		create_filename(palette_filename, m_bitmap_filename, EXT_NXP, m_args.compress & COMPRESS_PALETTE);
 		
-		FILE *palette_file = fopen(palette_filename, "wb");
-	
-		if (palette_file == NULL)
-		{
-			exit_with_msg("Can't create file %s.\n", palette_filename);
-		}
+		output_t *palette_file = open_output(palette_filename, false);
 	
 		write_file(palette_file, palette_filename, (uint8_t *)m_next_palette, next_palette_size, false, m_args.compress & COMPRESS_PALETTE);
 		
-		fclose(palette_file);
+		close_output(palette_file);
 	}
 }
 
-static void write_next_bitmap_file(FILE *bitmap_file, char *bitmap_filename, uint8_t *next_image, uint32_t next_image_size, bool use_compression)
+static void write_next_bitmap_file(output_t *bitmap_file, char *bitmap_filename, uint8_t *next_image, uint32_t next_image_size, bool use_compression)
 {
 	write_file(bitmap_file, bitmap_filename, next_image, next_image_size, false, use_compression);
 	
@@ -2313,30 +3355,60 @@ static void write_next_bitmap_file(FILE *bitmap_file, char *bitmap_filename, uin
 
 static uint8_t *get_bitmap_width_height(uint8_t *p_data, int bank_index, int bitmap_width, int bitmap_height, int *bank_size)
 {
-	static uint8_t bank[0xFFFF];
+	// Gathers a bitmap_width wide rectangle of the image into a bank, filled
+	// column by column, a row at a time. Columns past bitmap_width (when the
+	// bank size isn't a multiple of the rectangle height) are copied last,
+	// overwriting the start of the next row, as they always have been. The
+	// buffer holds those extra columns and the whole rectangle for the preview.
+	static uint8_t *bank = NULL;
+	static size_t bank_capacity = 0;
 	int bank_width = bitmap_width;
-	int bank_height = m_bank_size / bitmap_width;
+	int bank_height = (bitmap_width > 0 ? m_bank_size / bitmap_width : 0);
+	size_t bank_buffer_size = MAX((size_t)m_bank_size + bank_width, (size_t)bitmap_width * bitmap_height);
+	
+	if (bank_height == 0)
+	{
+		exit_with_msg("Bitmap size width %d doesn't fit in a bank of %d bytes.\n", bitmap_width, m_bank_size);
+	}
+	
+	if (bank_buffer_size > bank_capacity)
+	{
+		free(bank);
+		
+		if ((bank = malloc(bank_buffer_size)) == NULL)
+		{
+			exit_with_msg("Can't allocate memory for bitmap bank.\n");
+		}
+		
+		bank_capacity = bank_buffer_size;
+	}
+	
 	int rows = ceil((float)m_image_height / bank_height);
 	int offset_x = (bank_index / rows) * bank_width;
 	int offset_y = (bank_index % rows) * bank_height;
+	int copy_width = MAX(MIN(bank_width, (int)m_image_width - offset_x), 0);
 	int bank_count = 0;
 
-	memset(bank, 0, sizeof(bank));
+	memset(bank, 0, bank_buffer_size);
+
+	for (int y = 0; y < bank_height && offset_y + y < m_image_height; y++)
+	{
+		memcpy(&bank[y * bank_width], &p_data[offset_x + (offset_y + y) * m_image_width], copy_width);
+		
+		bank_count += copy_width;
+	}
 
-	for (int i = 0; i < m_bank_size; i++)
+	for (int i = bank_width * bank_height; i < m_bank_size; i++)
 	{
 		int x = i / bank_height;
 		int y = i % bank_height;
 		int image_x = offset_x + x;
 		int image_y = offset_y + y;
-		int image_offset = image_x + image_y * m_image_width;
-		int bank_offset = y * bank_width + x;
 		
 		if (image_x >= m_image_width || image_y >= m_image_height)
 			continue;
 
-		if (image_offset < m_image_size)
-			bank[bank_offset] = p_data[image_offset];
+		bank[y * bank_width + x] = p_data[image_x + image_y * m_image_width];
 		
 		bank_count++;
 	}
@@ -2351,48 +3423,44 @@ static uint8_t *get_bitmap_width_height(uint8_t *p_data, int bank_index, int bit
 
 static uint8_t *get_bank_width_height(uint8_t *p_data, int bank_index, int bank_width, int bank_height, int bank_size, int *bank_x)
 {
+	// Gathers bank_size bytes of a bank_width x bank_height cell, bank_x bytes
+	// per row (fewer at the right edge of the image), a row at a time.
 	static uint8_t bank[0xFFFF];
 	int offset_x = ((bank_index * bank_width) % m_image_width);
 	int offset_y = ((bank_index * bank_width) / m_image_width) * bank_height;
 	*bank_x = MIN(bank_width, m_image_width - offset_x);
+	int rows = bank_size / *bank_x;
+	int remainder = bank_size % *bank_x;
 	
-	memset(bank, 0, sizeof(bank));
+	memset(bank, 0, (rows + 1) * bank_width);
 	
-	for (int i = 0; i < bank_size; i++)
+	for (int y = 0; y < rows; y++)
 	{
-		int x = i % *bank_x;
-		int y = i / *bank_x;
-		
-		bank[y * bank_width + x] =  p_data[(offset_x + x) + (offset_y + y) * m_image_width];
+		memcpy(&bank[y * bank_width], &p_data[offset_x + (offset_y + y) * m_image_width], *bank_x);
+	}
+	
+	if (remainder)
+	{
+		memcpy(&bank[rows * bank_width], &p_data[offset_x + (offset_y + rows) * m_image_width], remainder);
 	}
 	
 	return bank;
 }
 
-static uint8_t *get_bank(uint8_t *p_data, int bank_size)
+static uint8_t *get_bank_view(uint8_t *p_data, int bank_index, int *bank_size)
 {
-	static uint8_t bank[0xFFFF];
-
-	memset(bank, 0, sizeof(bank));
-	
-	for (int i = 0; i < bank_size; i++)
-	{
-		bank[i] = p_data[i];
-	}
+	// Contiguous banks are used in place; -bitmap-size rectangles are gathered.
+	if (m_bitmap_width != 0 && m_bitmap_height != 0)
+		return get_bitmap_width_height(p_data, bank_index, m_bitmap_width, m_bitmap_height, bank_size);
 	
-	return bank;
+	return p_data + bank_index * m_bank_size;
 }
 
 /* static void write_1bit()
 {
 	char onebit_filename[256] = { 0 };
 	create_filename(onebit_filename, m_args.out_filename, EXT_BIN, true);
-	FILE *p_file = fopen(onebit_filename, "wb");
-	
-	if (p_file == NULL)
-	{
-		exit_with_msg("Can't create file %s.\n", onebit_filename);
-	}
+	output_t *p_file = open_output(onebit_filename, false);
 	
 	uint32_t image_size = (m_image_width * m_image_height) / 8;
 	uint8_t *p_buffer = malloc(image_size);
@@ -2409,19 +3477,14 @@ static uint8_t *get_bank(uint8_t *p_data, int bank_size)
 	write_file(p_file, onebit_filename, p_buffer, image_size, false, true);
 	
 	free(p_buffer);
-	fclose(p_file);
+	close_output(p_file);
 } */
 
 static void write_font()
 {
 	char font_filename[256] = { 0 };
 	create_filename(font_filename, m_args.out_filename, EXT_SPR, m_args.compress & COMPRESS_SPRITES);
-	FILE *p_file = fopen(font_filename, "wb");
-	
-	if (p_file == NULL)
-	{
-		exit_with_msg("Can't create file %s.\n", font_filename);
-	}
+	output_t *p_file = open_output(font_filename, false);
 	
 	uint32_t image_size = (m_image_width * m_image_height) / 8;
 	uint32_t char_count = image_size / 8;
@@ -2449,125 +3512,258 @@ static void write_font()
 	write_file(p_file, font_filename, p_buffer, image_size, false, m_args.compress & COMPRESS_SPRITES);
 	
 	free(p_buffer);
-	fclose(p_file);
+	close_output(p_file);
+}
+
+static void create_screen_color_table()
+{
+	// Nearest screen color for every palette index, so cells are solved with
+	// table lookups rather than a distance search per pixel.
+	for (int i = 0; i < NUM_PALETTE_COLORS; i++)
+	{
+		uint8_t r = m_palette[i * 4 + 1];
+		uint8_t g = m_palette[i * 4 + 2];
+		uint8_t b = m_palette[i * 4 + 3];
+		uint32_t min_dist = UINT32_MAX;
+		
+		for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+		{
+			int dr = (int)((m_screenColors[c] >> 16) & 0xff) - r;
+			int dg = (int)((m_screenColors[c] >> 8) & 0xff) - g;
+			int db = (int)(m_screenColors[c] & 0xff) - b;
+			uint32_t dist = dr * dr + dg * dg + db * db;
+			
+			if (dist < min_dist)
+			{
+				m_screen_color_index[i] = c;
+				min_dist = dist;
+			}
+		}
+	}
+	
+	for (int a = 0; a < SCREEN_COLOR_COUNT; a++)
+	{
+		for (int b = 0; b < SCREEN_COLOR_COUNT; b++)
+		{
+			int dr = (int)((m_screenColors[a] >> 16) & 0xff) - (int)((m_screenColors[b] >> 16) & 0xff);
+			int dg = (int)((m_screenColors[a] >> 8) & 0xff) - (int)((m_screenColors[b] >> 8) & 0xff);
+			int db = (int)(m_screenColors[a] & 0xff) - (int)(m_screenColors[b] & 0xff);
+			
+			m_screen_color_distance[a][b] = dr * dr + dg * dg + db * db;
+		}
+	}
+}
+
+static void get_screen_color_pair(const uint32_t *p_histogram, int *p_a, int *p_b)
+{
+	// Pick the pair of screen colors (sharing the bright bit, black goes with
+	// both) with the least squared error over a color histogram.
+	uint64_t min_error = UINT64_MAX;
+	
+	for (int a = 0; a < SCREEN_COLOR_COUNT; a++)
+	{
+		for (int b = a + 1; b < SCREEN_COLOR_COUNT; b++)
+		{
+			if (a != 0 && (a & 1) != (b & 1))
+				continue;
+			
+			uint64_t error = 0;
+			
+			for (int c = 0; c < SCREEN_COLOR_COUNT && error < min_error; c++)
+			{
+				if (p_histogram[c])
+					error += (uint64_t) p_histogram[c] * MIN(m_screen_color_distance[c][a], m_screen_color_distance[c][b]);
+			}
+			
+			if (error < min_error)
+			{
+				min_error = error;
+				*p_a = a;
+				*p_b = b;
+			}
+		}
+	}
+}
+
+static int get_screen_cell(int x, int y, int cell_height, uint8_t *p_bytes, uint8_t *p_colors, uint32_t *p_bit_count)
+{
+	// Solves one 8 x cell_height attribute cell. The colors used are collected
+	// as a bit set of screen color indices. The first pixel's color becomes
+	// p_colors[0] (paper) and pixels of the other color set their bit (ink).
+	// Returns the number of colors, or -1 when the cell has more than 2 colors
+	// and -screen-bestfit is not set.
+	uint8_t colors[8 * 8];
+	uint16_t color_mask = 0;
+	
+	for (int j = 0; j < cell_height; j++)
+	{
+		uint8_t *p_row = &m_next_image[(y + j) * m_image_width + x];
+		
+		for (int i = 0; i < 8; i++)
+		{
+			colors[j * 8 + i] = m_screen_color_index[p_row[i]];
+			color_mask |= 1 << colors[j * 8 + i];
+		}
+	}
+	
+	int color_count = __builtin_popcount(color_mask);
+	uint8_t map[SCREEN_COLOR_COUNT];
+	
+	for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+		map[c] = c;
+	
+	if (color_count > 2)
+	{
+		if (!m_args.screen_bestfit)
+			return -1;
+		
+		uint32_t histogram[SCREEN_COLOR_COUNT] = { 0 };
+		int best_a = 0, best_b = 0;
+		
+		for (int i = 0; i < cell_height * 8; i++)
+			histogram[colors[i]]++;
+		
+		get_screen_color_pair(histogram, &best_a, &best_b);
+		
+		for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+			map[c] = (m_screen_color_distance[c][best_b] < m_screen_color_distance[c][best_a] ? best_b : best_a);
+		
+		p_colors[0] = map[colors[0]];
+		p_colors[1] = (p_colors[0] == best_a ? best_b : best_a);
+		color_count = 2;
+	}
+	else
+	{
+		p_colors[0] = colors[0];
+		p_colors[1] = SCREEN_COLOR_NONE;
+		
+		for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+		{
+			if ((color_mask & (1 << c)) && c != colors[0])
+				p_colors[1] = c;
+		}
+	}
+	
+	p_bit_count[0] = 0;
+	p_bit_count[1] = 0;
+	
+	for (int j = 0; j < cell_height; j++)
+	{
+		uint8_t row = 0;
+		
+		for (int i = 0; i < 8; i++)
+		{
+			if (map[colors[j * 8 + i]] != p_colors[0])
+			{
+				row |= 1 << (7 - i);
+				p_bit_count[1]++;
+			}
+			else
+			{
+				p_bit_count[0]++;
+			}
+		}
+		
+		p_bytes[j] = row;
+	}
+	
+	return color_count;
+}
+
+static uint32_t create_screen_row_table(uint32_t *p_rows, uint32_t height, uint32_t bytes_per_row)
+{
+	// Offset of every pixel row in the Spectrum screen layout: thirds of 64
+	// rows, then the pixel line within a character row, then the character
+	// row. Returns the size of the pixel area, which for heights that are not
+	// a multiple of 64 includes the gaps of the last, partial third.
+	uint32_t size = 0;
+	
+	for (uint32_t y = 0; y < height; y++)
+	{
+		p_rows[y] = ((y >> 6) * 64 + ((y & 7) << 3) + ((y >> 3) & 7)) * bytes_per_row;
+		size = MAX(size, p_rows[y] + bytes_per_row);
+	}
+	
+	return size;
+}
+
+static void interleave_screen(uint8_t *p_dst, const uint8_t *p_src, const uint32_t *p_rows, uint32_t height, uint32_t bytes_per_row)
+{
+	for (uint32_t y = 0; y < height; y++)
+	{
+		memcpy(&p_dst[p_rows[y]], &p_src[y * bytes_per_row], bytes_per_row);
+	}
 }
 
 static void write_screen()
 {
 	char screen_filename[256] = { 0 };
 	create_filename(screen_filename, m_args.out_filename, EXT_SCR, m_args.compress & COMPRESS_SCREEN);
-	FILE *p_file = fopen(screen_filename, "wb");
+	output_t *p_file = open_output(screen_filename, false);
 	
-	if (p_file == NULL)
+	if ((m_image_width & 7) || (m_image_height & 7))
 	{
-		exit_with_msg("Can't create file %s.\n", screen_filename);
+		exit_with_msg("Screen size %d x %d is not a multiple of 8.\n", m_image_width, m_image_height);
 	}
 	
-	uint32_t image_size = (m_image_width * m_image_height) / 8;
 	uint32_t cols_count = m_image_width / 8;
 	uint32_t rows_count = m_image_height / 8;
-	uint32_t attrib_size = cols_count * rows_count;
+	uint32_t *p_rows = malloc(m_image_height * sizeof(uint32_t));
+	uint32_t image_size = create_screen_row_table(p_rows, m_image_height, cols_count);
+	uint32_t cell_height = (m_args.screen_hicolor ? 1 : 8);
+	uint32_t attrib_size = (m_args.screen_hicolor ? image_size : cols_count * rows_count);
 	uint32_t total_size = (m_args.screen_attribs ? image_size : image_size + attrib_size);
 	uint8_t *p_buffer = malloc(total_size);
-	uint8_t *p_pixels = malloc(image_size);
-	uint32_t *p_attrib = malloc(attrib_size * sizeof(uint32_t) * 2);
+	uint8_t *p_pixels = malloc(cols_count * m_image_height);
+	uint8_t *p_attrib = malloc(cols_count * (m_image_height / cell_height) * 2);
 	
-	int pixelCount = 0;
 	int attribCount = 0;
 	
 	memset(p_buffer, 0, total_size);
+	create_screen_color_table();
 	
-	for (int y = 0; y < m_image_height; y += 8)
+	for (int y = 0; y < m_image_height; y += cell_height)
 	{
 		for (int x = 0; x < m_image_width; x += 8)
 		{
-			int attrCount = 0;
-			uint32_t attr[2] = { 0 };
-			uint32_t bitCount[2] = { 0 };
+			uint8_t attr[2];
+			uint32_t bitCount[2];
 			uint8_t byte[8];
 			
-			for (int j = 0; j < 8; j++)
-			{
-				uint8_t row = 0;
-
-				for (int i = 0; i < 8; i++)
-				{
-					int index = x + i + (j + y) * m_image_width;
-					int colorIndex = m_next_image[index];
-					uint8_t r8 = m_palette[colorIndex * 4 + 1];
-					uint8_t g8 = m_palette[colorIndex * 4 + 2];
-					uint8_t b8 = m_palette[colorIndex * 4 + 3];
-					uint32_t rgb888 =  RGB888(r8, g8, b8);
-					uint32_t color = get_nearest_screen_color(rgb888);
-					
-					if (attrCount == 0)
-						attr[attrCount++] = color;
-					
-					if (color != attr[0])
-                    {
-						row |= 1 << (7 - i);
-                        // Increment bit count for ink
-                        bitCount[1]++;
-                    }
-                    else
-                    {
-                        // Increment bit count for paper
-                        bitCount[0]++;
-                    }
-					
-					bool attrFound = false;
-					
-					for (int k = 0; k < attrCount; k++)
-					{
-						if (attr[k] == color)
-							attrFound = true;
-					}
-					
-					if (!attrFound)
-					{
-						// Check attrCount before using it to prevent seg fault
-						if (attrCount > 1)
-							exit_with_msg("More than 2 colors in an attribute block at (%d, %d)\n", x/8, y/8);
-						attr[attrCount++] = color;
-					}
-				}
-				
-				byte[j] = row;
-			}
+			int attrCount = get_screen_cell(x, y, cell_height, byte, attr, bitCount);
+			
+			if (attrCount < 0)
+				exit_with_msg("More than 2 colors in an attribute block at (%d, %d)\n", x/8, y/cell_height);
 			
 			if(attrCount != 2)
 			{
 				// If only one colour, try to find a match in an adjacent cell
 				if (attribCount)
 				{
-					uint32_t *prevAttr = &p_attrib[attribCount - 2];
+					uint8_t *prevAttr = &p_attrib[attribCount - 2];
 					
 					if (prevAttr[0] == attr[0])
 						attr[attrCount++] = prevAttr[1];
 				}
 				
 				if (attrCount != 2)
-					attr[attrCount++] = m_screenColors[0];
+					attr[attrCount++] = 0;
 			}
 			
-			// Improve compression ratio
-			uint8_t paper = get_screen_color_attribs(attr[0], false);
-			uint8_t ink = get_screen_color_attribs(attr[1], true);
-			
             // If there are more ink bits than paper bits
             // switch them.
 			if (bitCount[1] > bitCount[0])
 			{
-				uint32_t attrTemp = attr[0];
+				uint8_t attrTemp = attr[0];
 				attr[0] = attr[1];
 				attr[1] = attrTemp;
 
-				for (int i = 0; i < 8; i++)
+				for (int i = 0; i < cell_height; i++)
 					byte[i] = ~byte[i] & 0xff;
 			}
 
-			for (int i = 0; i < 8; i++)
-				p_pixels[pixelCount++] = byte[i];
+			for (int i = 0; i < cell_height; i++)
+				p_pixels[(y + i) * cols_count + (x >> 3)] = byte[i];
 
 			p_attrib[attribCount++] = attr[0];
 			p_attrib[attribCount++] = attr[1];
@@ -2578,129 +3774,225 @@ static void write_screen()
 	{
 		for (int i = 0; i < attribCount >> 1; i++)
 		{
-			uint8_t paper = get_screen_color_attribs(p_attrib[i * 2], false);
-			uint8_t ink = get_screen_color_attribs(p_attrib[i * 2 + 1], true);
+			uint8_t paper = m_screenAttribsPaper[p_attrib[i * 2]];
+			uint8_t ink = m_screenAttribsInk[p_attrib[i * 2 + 1]];
 
-			p_buffer[image_size + i] = (paper | ink);
+			p_attrib[i] = (paper | ink);
 		}
-	}
-	
-	int pixelIndex = 0;
-	
-	for (int block = 0; block < 3; block++)
-	{
-		for (int col = 0; col < 8; col++)
+		
+		if (m_args.screen_hicolor)
 		{
-			for (int row = 0; row < 8; row++)
-			{
-				for (int line = 0; line < 32; line++)
-				{
-					p_buffer[pixelIndex++] = p_pixels[(block * 8 * 8 * 32) + (row * 32 * 8) + (line * 8) + col];
-				}
-			}
+			// Timex hi-colour: one attribute per pixel row of a cell, laid out like the pixels.
+			interleave_screen(&p_buffer[image_size], p_attrib, p_rows, m_image_height, cols_count);
+		}
+		else
+		{
+			memcpy(&p_buffer[image_size], p_attrib, attrib_size);
 		}
 	}
 	
+	interleave_screen(p_buffer, p_pixels, p_rows, m_image_height, cols_count);
+	
+	free(p_rows);
 	free(p_pixels);
 	free(p_attrib);
 	
 	write_file(p_file, screen_filename, p_buffer, total_size, false, m_args.compress & COMPRESS_SCREEN);
 	
 	free(p_buffer);
-	fclose(p_file);
+	close_output(p_file);
 }
 
-static void write_attribs()
+static void write_screen_hires()
 {
+	// Timex hi-res: a two color bitmap of twice the width, with the even
+	// bytes of each row in the first screen and the odd bytes in the second.
+	// The hardware only shows an ink color and its complement as paper, set
+	// with bits 3-5 of port 0xFF, and has no bright.
 	char screen_filename[256] = { 0 };
-	create_filename(screen_filename, m_args.out_filename, EXT_NXP, m_args.compress & COMPRESS_SCREEN);
-	FILE *p_file = fopen(screen_filename, "wb");
-
-	if (p_file == NULL)
+	create_filename(screen_filename, m_args.out_filename, EXT_SCR, m_args.compress & COMPRESS_SCREEN);
+	output_t *p_file = open_output(screen_filename, false);
+	
+	if ((m_image_width & 15) || (m_image_height & 7))
 	{
-		exit_with_msg("Can't create file %s.\n", screen_filename);
+		exit_with_msg("Hi-res screen size %d x %d is not a multiple of 16 x 8.\n", m_image_width, m_image_height);
 	}
-
-	uint32_t cols_count = m_image_width / 8;
-	uint32_t rows_count = m_image_height / 8;
-	uint32_t attrib_size = cols_count * rows_count;
-	uint8_t *p_buffer = malloc(attrib_size);
-	uint32_t *p_attrib = malloc(attrib_size * sizeof(uint32_t) * 2);
-
-	int attribCount = 0;
-
-	memset(p_buffer, 0, attrib_size);
-
-	for (int y = 0; y < m_image_height; y += 8)
+	
+	uint32_t cols_count = m_image_width / 16;
+	uint32_t *p_rows = malloc(m_image_height * sizeof(uint32_t));
+	uint32_t image_size = create_screen_row_table(p_rows, m_image_height, cols_count);
+	uint32_t total_size = image_size * 2;
+	uint8_t *p_buffer = malloc(total_size);
+	uint8_t *p_pixels = malloc(cols_count * m_image_height * 2);
+	uint32_t histogram[SCREEN_COLOR_COUNT] = { 0 };
+	uint8_t map[SCREEN_COLOR_COUNT];
+	uint64_t min_error = UINT64_MAX;
+	int ink_color = 0;
+	
+	memset(p_buffer, 0, total_size);
+	create_screen_color_table();
+	
+	for (int i = 0; i < m_image_width * m_image_height; i++)
+		histogram[m_screen_color_index[m_next_image[i]]]++;
+	
+	// Non-bright complementary pairs (black/white, blue/yellow, red/cyan and
+	// magenta/green) with the least squared error. Screen color index 2k - 1
+	// is the non-bright Spectrum color k.
+	for (int k = 0; k < 4; k++)
 	{
-		for (int x = 0; x < m_image_width; x += 8)
+		int a = (k == 0 ? 0 : k * 2 - 1);
+		int b = (7 - k) * 2 - 1;
+		uint64_t error = 0;
+		
+		for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
 		{
-			int attrCount = 0;
-			uint32_t attr[2] = { 0 };
-
-			for (int j = 0; j < 8; j++)
-			{
-				for (int i = 0; i < 8; i++)
-				{
-					int index = x + i + (j + y) * m_image_width;
-					int colorIndex = m_next_image[index];
+			if (histogram[c])
+				error += (uint64_t) histogram[c] * MIN(m_screen_color_distance[c][a], m_screen_color_distance[c][b]);
+		}
+		
+		if (error < min_error)
+		{
+			min_error = error;
+			ink_color = k;
+		}
+	}
+	
+	if (min_error > 0 && !m_args.screen_bestfit)
+	{
+		exit_with_msg("Hi-res screen colors are not black/white, blue/yellow, red/cyan or magenta/green without bright.\n");
+	}
+	
+	int ink = (ink_color == 0 ? 0 : ink_color * 2 - 1);
+	int paper = (7 - ink_color) * 2 - 1;
+	
+	for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+		map[c] = (m_screen_color_distance[c][ink] < m_screen_color_distance[c][paper] ? ink : paper);
+	
+	uint32_t paper_count = 0, ink_count = 0;
+	
+	for (int c = 0; c < SCREEN_COLOR_COUNT; c++)
+	{
+		if (map[c] == paper)
+			paper_count += histogram[c];
+		else
+			ink_count += histogram[c];
+	}
+	
+	// Use the more common color as paper, which is the complementary ink.
+	if (ink_count > paper_count)
+	{
+		int temp = paper;
+		paper = ink;
+		ink = temp;
+		ink_color = 7 - ink_color;
+	}
+	
+	uint8_t port_value = 0x06 | (ink_color << 3);
+	
+	printf("Hi-res Colors = paper %d, ink %d (port 0xFF = 0x%02X)\n", 7 - ink_color, ink_color, port_value);
+	
+	for (int y = 0; y < m_image_height; y++)
+	{
+		uint8_t *p_row = &m_next_image[y * m_image_width];
+		
+		for (int x = 0; x < m_image_width; x += 8)
+		{
+			uint8_t byte = 0;
+			
+			for (int i = 0; i < 8; i++)
+			{
+				if (map[m_screen_color_index[p_row[x + i]]] != paper)
+					byte |= 1 << (7 - i);
+			}
+			
+			// Even bytes go to the first screen, odd bytes to the second.
+			uint32_t column = x >> 3;
+			p_pixels[(column & 1) * cols_count * m_image_height + y * cols_count + (column >> 1)] = byte;
+		}
+	}
+	
+	interleave_screen(p_buffer, p_pixels, p_rows, m_image_height, cols_count);
+	interleave_screen(&p_buffer[image_size], &p_pixels[cols_count * m_image_height], p_rows, m_image_height, cols_count);
+	
+	free(p_rows);
+	free(p_pixels);
+	
+	write_file(p_file, screen_filename, p_buffer, total_size, false, m_args.compress & COMPRESS_SCREEN);
+	
+	if (m_args.asm_mode > ASMMODE_NONE)
+	{
+		write_asm_timex_mode(screen_filename, port_value);
+		
+		if (m_args.asm_mode == ASMMODE_Z80ASM)
+		{
+			write_header_timex_mode(screen_filename, port_value);
+		}
+	}
+	
+	free(p_buffer);
+	close_output(p_file);
+}
 
-					uint8_t r8 = m_palette[colorIndex * 4 + 1];
-					uint8_t g8 = m_palette[colorIndex * 4 + 2];
-					uint8_t b8 = m_palette[colorIndex * 4 + 3];
-					uint32_t rgb888 =  RGB888(r8, g8, b8);
-					uint32_t color = get_nearest_screen_color(rgb888);
+static void write_attribs()
+{
+	char screen_filename[256] = { 0 };
+	create_filename(screen_filename, m_args.out_filename, EXT_NXP, m_args.compress & COMPRESS_SCREEN);
+	output_t *p_file = open_output(screen_filename, false);
 
-					if (attrCount == 0)
-						attr[attrCount++] = color;
+	uint32_t cols_count = m_image_width / 8;
+	uint32_t rows_count = m_image_height / 8;
+	uint32_t attrib_size = cols_count * rows_count;
+	uint8_t *p_buffer = malloc(attrib_size);
+	uint8_t *p_attrib = malloc(attrib_size * 2);
 
-					bool attrFound = false;
+	int attribCount = 0;
 
-					for (int k = 0; k < attrCount; k++)
-					{
-						if (attr[k] == color)
-							attrFound = true;
-					}
+	memset(p_buffer, 0, attrib_size);
+	create_screen_color_table();
 
-					if (!attrFound)
-					{
-						if (attrCount > 1)
-							exit_with_msg("More than 2 colors in an attribute block at (%d, %d)\n", x/8, y/8);
-						attr[attrCount++] = color;
-					}
-				}
-			}
+	for (int y = 0; y < m_image_height; y += 8)
+	{
+		for (int x = 0; x < m_image_width; x += 8)
+		{
+			uint8_t attr[2];
+			uint32_t bitCount[2];
+			uint8_t byte[8];
+
+			int attrCount = get_screen_cell(x, y, 8, byte, attr, bitCount);
+
+			if (attrCount < 0)
+				exit_with_msg("More than 2 colors in an attribute block at (%d, %d)\n", x/8, y/8);
 
 			if(attrCount != 2)
 			{
 				if(m_args.pal_zx_default != -1)
 				{
-					p_attrib[attribCount++] = 0xffffffff;
-					p_attrib[attribCount++] = 0xffffffff;
+					p_attrib[attribCount++] = SCREEN_COLOR_NONE;
+					p_attrib[attribCount++] = SCREEN_COLOR_NONE;
 					continue;
 				}
 				// If only one colour, try to find a match in an adjacent cell
 				if (attribCount >= 2)
 				{
-					uint32_t *prevAttr = &p_attrib[attribCount - 2];
+					uint8_t *prevAttr = &p_attrib[attribCount - 2];
 
 					if (prevAttr[0] == attr[0])
 						attr[attrCount++] = prevAttr[1];
 				}
 
 				if (attrCount != 2)
-					attr[attrCount++] = m_screenColors[0];
+					attr[attrCount++] = 0;
 			}
 
-			uint8_t paper = get_screen_color_attribs(attr[0], false);
-			uint8_t ink = get_screen_color_attribs(attr[1], true);
+			uint8_t paper = m_screenAttribsPaper[attr[0]];
+			uint8_t ink = m_screenAttribsInk[attr[1]];
 
 			if (paper > ink)
 			{
 				// Swap attr 0&1
-				attr[0] ^= attr[1];
-				attr[1] ^= attr[0];
-				attr[0] ^= attr[1];
+				uint8_t attrTemp = attr[0];
+				attr[0] = attr[1];
+				attr[1] = attrTemp;
 			}
 
 			p_attrib[attribCount++] = attr[0];
@@ -2710,14 +4002,14 @@ static void write_attribs()
 
 	for (int i = 0; i < attribCount >> 1; i++)
 	{
-		if(p_attrib[i * 2] == 0xffffffff)
+		if(p_attrib[i * 2] == SCREEN_COLOR_NONE)
 		{
 			p_buffer[i] = m_args.pal_zx_default;
 		}
 		else
 		{
-			uint8_t paper = get_screen_color_attribs(p_attrib[i * 2], false);
-			uint8_t ink = get_screen_color_attribs(p_attrib[i * 2 + 1], true);
+			uint8_t paper = m_screenAttribsPaper[p_attrib[i * 2]];
+			uint8_t ink = m_screenAttribsInk[p_attrib[i * 2 + 1]];
 			p_buffer[i] = (paper | ink);
 		}
 	}
@@ -2726,7 +4018,7 @@ static void write_attribs()
 
 	free(p_attrib);
 	free(p_buffer);
-	fclose(p_file);
+	close_output(p_file);
 }
 
 static void write_next_bitmap()
@@ -2737,6 +4029,11 @@ static void write_next_bitmap()
 		
 		m_bank_count = 0;
 		
+		if (m_args.preview)
+		{
+			begin_png_queue();
+		}
+		
 		while (size > 0)
 		{
 			int bank_size = (size < m_bank_size ? size : m_bank_size);
@@ -2750,23 +4047,13 @@ static void write_next_bitmap()
 				alphanumeric_to_underscore(m_asm_labels[m_bank_count]);
 			}
 
-			FILE *bitmap_file = fopen(m_bitmap_filename, "wb");
-	
-			if (bitmap_file == NULL)
-			{
-				exit_with_msg("Can't create file %s.\n", m_bitmap_filename);
-			}
+			output_t *bitmap_file = open_output(m_bitmap_filename, false);
 			
-			uint8_t *p_image = NULL;
-
-			if (m_bitmap_width != 0 && m_bitmap_height != 0)
-				p_image = get_bitmap_width_height(m_next_image, m_bank_count, m_bitmap_width, m_bitmap_height, &bank_size);
-			else
-				p_image = get_bank(m_next_image + m_bank_count * m_bank_size, bank_size);
+			uint8_t *p_image = get_bank_view(m_next_image, m_bank_count, &bank_size);
 			
 			write_file(bitmap_file, m_bitmap_filename, p_image, bank_size, false, m_args.compress & COMPRESS_BITMAP);
 			
-			fclose(bitmap_file);
+			close_output(bitmap_file);
 
 			if (m_args.preview)
 			{
@@ -2781,6 +4068,11 @@ static void write_next_bitmap()
 			size -= bank_size;
 			m_bank_count++;
 		}
+		
+		if (m_args.preview)
+		{
+			end_png_queue();
+		}
 	}
 	else
 	{
@@ -2837,6 +4129,128 @@ void c2p(uint8_t *source, uint32_t size)
 	}
 }
 
+typedef struct
+{
+	uint8_t *p_data;
+	uint32_t sizes[64];
+	size_t compressed_sizes[64];
+} bank_probe_t;
+
+static size_t get_compressed_size_estimate(uint8_t *p_data, uint32_t data_size, bool greedy)
+{
+	size_t (*p_estimate)(unsigned char *, size_t, bool, bool) = (greedy ? zx0_estimate_greedy : zx0_estimate);
+	size_t size = p_estimate(p_data, data_size, m_args.zx0_quick, m_args.zx0_auto ? false : m_args.zx0_back);
+	
+	// -zx0-auto writes whichever direction is smaller.
+	if (m_args.zx0_auto)
+		size = MIN(size, p_estimate(p_data, data_size, m_args.zx0_quick, true));
+	
+	return size;
+}
+
+static void bank_probe(void *p_arg, int index)
+{
+	bank_probe_t *p_probe = (bank_probe_t *)p_arg;
+	
+	p_probe->compressed_sizes[index] = get_compressed_size_estimate(p_probe->p_data, p_probe->sizes[index], false);
+}
+
+static uint32_t get_packed_bank_size(uint8_t *p_data, uint32_t data_size, uint32_t unit_size, uint8_t **p_compressed_buffer, size_t *p_compressed_size, bool *p_backwards_mode)
+{
+	// Largest whole number of units whose compressed size fits in a bank. The
+	// greedy estimate never undercuts the real size, so a binary search with it
+	// gives a size that is known to fit. Above that, each round estimates evenly
+	// spaced candidate sizes in parallel and narrows the range to between the
+	// largest that fits and the next that doesn't. The result is compressed
+	// for real and handed back so the bank is only compressed once.
+	uint32_t unit_count = data_size / unit_size;
+	uint32_t low = 1, high = unit_count;
+	int probe_count = MIN(MAX(get_thread_count(), 2), 64);
+	bank_probe_t probe = { p_data };
+	int rounds = 0;
+	
+	if (unit_count == 0)
+		return 0;
+	
+	// Everything left fits, or there is only one unit to place.
+	if (unit_count <= 1 || get_compressed_size_estimate(p_data, data_size, true) <= m_bank_size ||
+		get_compressed_size_estimate(p_data, data_size, false) <= m_bank_size)
+	{
+		low = high = unit_count;
+	}
+	
+	while (high - low > 1)
+	{
+		uint32_t units = low + (high - low) / 2;
+		
+		if (get_compressed_size_estimate(p_data, units * unit_size, true) <= m_bank_size)
+			low = units;
+		else
+			high = units;
+	}
+	
+	if (low < unit_count)
+		high = unit_count;
+	
+	while (high - low > 1)
+	{
+		int count = 0;
+		
+		for (int i = 1; i <= probe_count; i++)
+		{
+			uint32_t units = low + (uint64_t)(high - low) * i / (probe_count + 1);
+			
+			if (units > low && units < high && (count == 0 || units != probe.sizes[count - 1] / unit_size))
+				probe.sizes[count++] = units * unit_size;
+		}
+		
+		if (count == 0)
+			break;
+		
+		run_parallel(bank_probe, &probe, count);
+		rounds++;
+		
+		for (int i = 0; i < count; i++)
+		{
+			if (probe.compressed_sizes[i] > m_bank_size)
+			{
+				high = probe.sizes[i] / unit_size;
+				break;
+			}
+			
+			low = probe.sizes[i] / unit_size;
+		}
+	}
+	
+	// The estimates only choose the size, the compressed bank has to fit too.
+	while (true)
+	{
+		double start_ms = get_time_ms();
+		
+		*p_backwards_mode = m_args.zx0_back;
+		*p_compressed_buffer = compress_buffer(p_data, low * unit_size, p_compressed_size, p_backwards_mode);
+		
+		stats_end(STAGE_COMPRESS, start_ms);
+		
+		if (*p_compressed_size <= m_bank_size)
+			break;
+		
+		free(*p_compressed_buffer);
+		
+		if (low <= 1)
+		{
+			exit_with_msg("Bank pack can't fit %d unit of %d bytes in a bank of %d bytes (%d bytes compressed).\n", low, unit_size, m_bank_size, (int) *p_compressed_size);
+		}
+		
+		low--;
+	}
+	
+	if (m_args.debug)
+		printf("Bank Pack = %d units in %d rounds\n", low, rounds);
+	
+	return low * unit_size;
+}
+
 static void write_tiles_sprites()
 {
 	char out_filename[256] = { 0 };
@@ -2857,11 +4271,26 @@ static void write_tiles_sprites()
 
 	if (m_args.bank_size > BANKSIZE_NONE)
 	{
+		uint32_t data_offset = 0;
+		
 		m_bank_count = 0;
+		
+		if (m_args.preview)
+		{
+			begin_png_queue();
+		}
 
 		while (data_size > 0)
 		{
 			uint32_t bank_size = (data_size < m_bank_size ? data_size : m_bank_size);
+			uint8_t *compressed_buffer = NULL;
+			size_t compressed_size = 0;
+			bool backwards_mode = false;
+			
+			if (m_args.bank_pack && use_compression)
+			{
+				bank_size = get_packed_bank_size(&m_tiles[data_offset], data_size, tile_size, &compressed_buffer, &compressed_size, &backwards_mode);
+			}
 			
 			if (bank_size == 0)
 				break;
@@ -2875,16 +4304,18 @@ static void write_tiles_sprites()
 				alphanumeric_to_underscore(m_asm_labels[m_bank_count]);
 			}
 			
-			FILE *p_file = fopen(out_filename, "wb");
-
-			if (p_file == NULL)
+			output_t *p_file = open_output(out_filename, false);
+			
+			if (compressed_buffer != NULL)
 			{
-				exit_with_msg("Can't create file %s.\n", out_filename);
+				write_compressed_file(p_file, out_filename, &m_tiles[data_offset], bank_size, compressed_buffer, compressed_size, backwards_mode);
+			}
+			else
+			{
+				write_file(p_file, out_filename, &m_tiles[data_offset], bank_size, false, use_compression);
 			}
 			
-			write_file(p_file, out_filename, &m_tiles[m_bank_count * m_bank_size], bank_size, false, use_compression);
-			
-			fclose(p_file);
+			close_output(p_file);
 
 			if (m_args.preview)
 			{
@@ -2900,23 +4331,24 @@ static void write_tiles_sprites()
 			}
 			
 			m_bank_count++;
+			data_offset += bank_size;
 			data_size -= bank_size;
 		}
+		
+		if (m_args.preview)
+		{
+			end_png_queue();
+		}
 	}
 	else
 	{
 		create_filename(out_filename, m_args.out_filename, extension, use_compression);
 		
-		FILE *p_file = fopen(out_filename, "wb");
-		
-		if (p_file == NULL)
-		{
-			exit_with_msg("Can't create file %s.\n", out_filename);
-		}
+		output_t *p_file = open_output(out_filename, false);
 
 		write_file(p_file, out_filename, m_tiles, data_size, false, use_compression);
 		
-		fclose(p_file);
+		close_output(p_file);
 		
 		if (m_args.preview)
 		{
@@ -2946,12 +4378,7 @@ static void write_blocks()
 {
 	char block_filename[256] = { 0 };
 	create_filename(block_filename, m_args.out_filename, EXT_NXB, m_args.compress & COMPRESS_BLOCKS);
-	FILE *p_file = fopen(block_filename, "wb");
-	
-	if (p_file == NULL)
-	{
-		exit_with_msg("Can't create file %s.\n", block_filename);
-	}
+	output_t *p_file = open_output(block_filename, false);
 	
 	uint32_t block_bytes = m_args.block_16bit ? 2 : 1;
 	uint32_t block_size = block_bytes * m_block_count * m_block_width * m_block_height;
@@ -2976,7 +4403,116 @@ static void write_blocks()
 	write_file(p_file, block_filename, p_buffer, block_size, false, m_args.compress & COMPRESS_BLOCKS);
 	
 	free(p_buffer);
-	fclose(p_file);
+	close_output(p_file);
+}
+
+static char *write_uint(char *p_text, uint32_t value)
+{
+	char digits[10];
+	int count = 0;
+	
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	
+	while (count > 0)
+		*p_text++ = digits[--count];
+	
+	return p_text;
+}
+
+static char *write_base64(char *p_text, uint8_t *p_data, uint32_t data_size)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	
+	for (uint32_t i = 0; i < data_size; i += 3)
+	{
+		uint32_t bits = (p_data[i] << 16) | (i + 1 < data_size ? p_data[i + 1] << 8 : 0) | (i + 2 < data_size ? p_data[i + 2] : 0);
+		
+		*p_text++ = table[(bits >> 18) & 63];
+		*p_text++ = table[(bits >> 12) & 63];
+		*p_text++ = (i + 1 < data_size ? table[(bits >> 6) & 63] : '=');
+		*p_text++ = (i + 2 < data_size ? table[bits & 63] : '=');
+	}
+	
+	return p_text;
+}
+
+static void write_text(output_t *p_file, char *p_filename, char *p_text, size_t text_size)
+{
+	write_output(p_file, p_text, text_size);
+}
+
+static void write_tiled_csv(output_t *p_file, char *p_filename, uint32_t *p_values, uint32_t value_count, uint32_t line_length)
+{
+	// At most 10 digits and a separator per value, formatted into one buffer.
+	char *p_text = malloc((size_t)value_count * 11 + 1);
+	char *p = p_text;
+	
+	if (p_text == NULL)
+	{
+		exit_with_msg("Can't allocate memory for file %s.\n", p_filename);
+	}
+	
+	for (uint32_t i = 0; i < value_count; i++)
+	{
+		p = write_uint(p, p_values[i]);
+		*p++ = ',';
+		
+		if ((i + 1) % line_length == 0)
+			*p++ = '\n';
+	}
+	
+	// No separator after the last value.
+	if (value_count > 0)
+	{
+		p[-2] = '\n';
+		p--;
+	}
+	
+	write_text(p_file, p_filename, p_text, p - p_text);
+	
+	free(p_text);
+}
+
+static void write_tiled_zlib(output_t *p_file, char *p_filename, uint32_t *p_values, uint32_t value_count)
+{
+	uint8_t *p_data = malloc((size_t)value_count * 4);
+	uint8_t *p_compressed = NULL;
+	size_t compressed_size = 0;
+	
+	if (p_data == NULL)
+	{
+		exit_with_msg("Can't allocate memory for file %s.\n", p_filename);
+	}
+	
+	for (uint32_t i = 0; i < value_count; i++)
+	{
+		p_data[i * 4 + 0] = p_values[i] & 0xff;
+		p_data[i * 4 + 1] = (p_values[i] >> 8) & 0xff;
+		p_data[i * 4 + 2] = (p_values[i] >> 16) & 0xff;
+		p_data[i * 4 + 3] = (p_values[i] >> 24) & 0xff;
+	}
+	
+	if (lodepng_zlib_compress(&p_compressed, &compressed_size, p_data, (size_t)value_count * 4, &lodepng_default_compress_settings))
+	{
+		exit_with_msg("Can't compress layer data for file %s.\n", p_filename);
+	}
+	
+	char *p_text = malloc((compressed_size + 2) / 3 * 4);
+	
+	if (p_text == NULL)
+	{
+		exit_with_msg("Can't allocate memory for file %s.\n", p_filename);
+	}
+	
+	write_text(p_file, p_filename, p_text, write_base64(p_text, p_compressed, compressed_size) - p_text);
+	
+	free(p_text);
+	free(p_compressed);
+	free(p_data);
 }
 
 static void write_tiled_files(uint32_t image_width, uint32_t image_height, uint32_t tile_width, uint32_t tile_height, uint32_t block_width, uint32_t block_height, bool use_tsx)
@@ -2986,7 +4522,7 @@ static void write_tiled_files(uint32_t image_width, uint32_t image_height, uint3
 	create_filename(png_filename, m_args.out_filename, "_tileset.png", false);
 	create_filename(tmx_filename, m_args.out_filename, EXT_TMX, false);
 	create_filename(tsx_filename, m_args.out_filename, EXT_TSX, false);
-	FILE *p_tmx_file = fopen(tmx_filename, "w");
+	output_t *p_tmx_file = open_output(tmx_filename, false);
 	
 	uint32_t tile_count = MIN(m_tile_count, m_args.map_16bit ? 512 : 256);
 	uint32_t bitmap_width = 0, bitmap_height = 0;
@@ -2998,165 +4534,611 @@ static void write_tiled_files(uint32_t image_width, uint32_t image_height, uint3
 	uint16_t map_mask = m_args.map_16bit ? 0x1ff : 0xff;
 	uint32_t first_gid = 1;
 	
-	fprintf(p_tmx_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-	fprintf(p_tmx_file, "<map version=\"1.5\" tiledversion=\"1.7.0\" orientation=\"orthogonal\" renderorder=\"right-down\" width=\"%d\" height=\"%d\" tilewidth=\"%d\" tileheight=\"%d\" infinite=\"0\" backgroundcolor=\"#ff00ff\" nextlayerid=\"2\" nextobjectid=\"1\">\n", map_width, map_height, tile_width, tile_height);
+	print_output(p_tmx_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	print_output(p_tmx_file, "<map version=\"1.5\" tiledversion=\"1.7.0\" orientation=\"orthogonal\" renderorder=\"right-down\" width=\"%d\" height=\"%d\" tilewidth=\"%d\" tileheight=\"%d\" infinite=\"0\" backgroundcolor=\"#ff00ff\" nextlayerid=\"2\" nextobjectid=\"1\">\n", map_width, map_height, tile_width, tile_height);
 	
 	if (use_tsx)
 	{
-		fprintf(p_tmx_file, " <tileset firstgid=\"%d\" source=\"%s\"/>\n", first_gid, tsx_filename);
+		print_output(p_tmx_file, " <tileset firstgid=\"%d\" source=\"%s\"/>\n", first_gid, tsx_filename);
 	}
 	else
 	{
-		fprintf(p_tmx_file, "<tileset firstgid=\"%d\" name=\"%s\" tilewidth=\"%d\" tileheight=\"%d\" tilecount=\"%d\" columns=\"%d\">\n", first_gid, name, tile_width, tile_height, tile_count, bitmap_width / tile_width);
-		fprintf(p_tmx_file, " <image source=\"%s\" width=\"%d\" height=\"%d\"/>\n", png_filename, bitmap_width, bitmap_height);
-		fprintf(p_tmx_file, "</tileset>\n");
+		print_output(p_tmx_file, "<tileset firstgid=\"%d\" name=\"%s\" tilewidth=\"%d\" tileheight=\"%d\" tilecount=\"%d\" columns=\"%d\">\n", first_gid, name, tile_width, tile_height, tile_count, bitmap_width / tile_width);
+		print_output(p_tmx_file, " <image source=\"%s\" width=\"%d\" height=\"%d\"/>\n", png_filename, bitmap_width, bitmap_height);
+		print_output(p_tmx_file, "</tileset>\n");
 	}
-	fprintf(p_tmx_file, " <layer id=\"1\" name=\"Tile Layer 1\" width=\"%d\" height=\"%d\">\n", map_width, map_height);
-	fprintf(p_tmx_file, "  <data encoding=\"csv\">\n");
-
-	if (m_args.map_y)
+	print_output(p_tmx_file, " <layer id=\"1\" name=\"Tile Layer 1\" width=\"%d\" height=\"%d\">\n", map_width, map_height);
+	uint32_t cell_count = map_width * map_height;
+	uint32_t *p_values = malloc(cell_count * sizeof(uint32_t));
+	uint32_t line_length = (m_args.map_y ? map_height : map_width);
+	
+	if (p_values == NULL)
 	{
-		for (int x = 0; x < map_width; x++)
-		{
-			for (int y = 0; y < map_height; y++)
-			{
-				uint16_t tile_id = m_map[y * map_width + x];
-				uint8_t tile_flags = attributes_to_tiled_flags(tile_id >> 8);
-				uint32_t tile_value = ((tile_id & map_mask) + first_gid) | (tile_flags << 28);
-				
-				if (x == map_width-1 && y == map_height-1)
-					fprintf(p_tmx_file, "%u", tile_value);
-				else
-					fprintf(p_tmx_file, "%u,", tile_value);
-			}
-			fprintf(p_tmx_file, "\n");
-		}
+		exit_with_msg("Can't allocate memory for file %s.\n", tmx_filename);
+	}
+	
+	// Cells in file order, rows of the csv are columns of the map with -map-y.
+	for (uint32_t i = 0; i < cell_count; i++)
+	{
+		uint32_t x = (m_args.map_y ? i / map_height : i % map_width);
+		uint32_t y = (m_args.map_y ? i % map_height : i / map_width);
+		uint16_t tile_id = m_map[y * map_width + x];
+		uint8_t tile_flags = attributes_to_tiled_flags(tile_id >> 8);
+		
+		p_values[i] = ((tile_id & map_mask) + first_gid) | (tile_flags << 28);
+	}
+	
+	if (m_args.tiled_zlib)
+	{
+		print_output(p_tmx_file, "  <data encoding=\"base64\" compression=\"zlib\">\n   ");
+		
+		write_tiled_zlib(p_tmx_file, tmx_filename, p_values, cell_count);
+		
+		print_output(p_tmx_file, "\n");
 	}
 	else
 	{
-		for (int y = 0; y < map_height; y++)
-		{
-			for (int x = 0; x < map_width; x++)
-			{
-				uint16_t tile_id = m_map[y * map_width + x];
-				uint8_t tile_flags = attributes_to_tiled_flags(tile_id >> 8);
-				uint32_t tile_value = ((tile_id & map_mask) + first_gid) | (tile_flags << 28);
-				
-				if (x == map_width-1 && y == map_height-1)
-					fprintf(p_tmx_file, "%u", tile_value);
-				else
-					fprintf(p_tmx_file, "%u,", tile_value);
-			}
-			fprintf(p_tmx_file, "\n");
-		}
+		print_output(p_tmx_file, "  <data encoding=\"csv\">\n");
+		
+		write_tiled_csv(p_tmx_file, tmx_filename, p_values, cell_count, line_length);
 	}
 	
-	fprintf(p_tmx_file, "  </data>\n");
-	fprintf(p_tmx_file, " </layer>\n");
-	fprintf(p_tmx_file, "</map>\n");
+	free(p_values);
+	
+	print_output(p_tmx_file, "  </data>\n");
+	print_output(p_tmx_file, " </layer>\n");
+	print_output(p_tmx_file, "</map>\n");
 
-	fclose(p_tmx_file);
+	close_output(p_tmx_file);
 	
 	if (use_tsx)
 	{
-		FILE *p_tsx_file = fopen(tsx_filename, "w");
+		output_t *p_tsx_file = open_output(tsx_filename, false);
 		
-		fprintf(p_tsx_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-		fprintf(p_tsx_file, "<tileset version=\"1.4\" tiledversion=\"1.4.1\" name=\"%s\" tilewidth=\"%d\" tileheight=\"%d\" tilecount=\"%d\" columns=\"%d\">\n", name, tile_width, tile_height, tile_count, bitmap_width / tile_width);
-		fprintf(p_tsx_file, " <image source=\"%s\" width=\"%d\" height=\"%d\"/>\n", png_filename, bitmap_width, bitmap_height);
-		fprintf(p_tsx_file, "</tileset>\n");
+		print_output(p_tsx_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		print_output(p_tsx_file, "<tileset version=\"1.4\" tiledversion=\"1.4.1\" name=\"%s\" tilewidth=\"%d\" tileheight=\"%d\" tilecount=\"%d\" columns=\"%d\">\n", name, tile_width, tile_height, tile_count, bitmap_width / tile_width);
+		print_output(p_tsx_file, " <image source=\"%s\" width=\"%d\" height=\"%d\"/>\n", png_filename, bitmap_width, bitmap_height);
+		print_output(p_tsx_file, "</tileset>\n");
 
-		fclose(p_tsx_file);
+		close_output(p_tsx_file);
 	}
 }
 
-static void write_map_png(char *png_filename, uint8_t *map, uint32_t map_bytes, uint32_t map_width, uint32_t map_height, uint32_t tile_width, uint32_t tile_height, uint32_t block_width, uint32_t block_height)
+typedef struct
 {
-	if (1 != block_width || 1 != block_height)
-	{
-		// TODO implement non 1x1 blocks
-		printf("Warning tilemap preview png implements only 1x1 size blocks.\n");
+	uint32_t tile;
+	uint8_t orientation;
+	uint8_t palette;
+} preview_cell_t;
+
+typedef struct
+{
+	preview_cell_t *p_cells;
+	uint8_t *p_variants[8];
+	uint8_t *p_image;
+	uint32_t cells_per_row;
+	uint32_t rows_per_cell;
+	uint32_t tile_width;
+	uint32_t tile_height;
+	uint32_t png_width;
+	uint8_t orientations;
+} map_preview_job_t;
+
+static uint32_t get_map_cell_index(uint32_t mx, uint32_t my, uint32_t map_width, uint32_t map_height)
+{
+	// m_map is in column order with -tile-y and write_map() transposes it with -map-y.
+	uint32_t index = m_args.tile_y ? mx * map_height + my : my * map_width + mx;
+	
+	return m_args.map_y ? (index % map_width) * map_height + index / map_width : index;
+}
+
+static void map_preview_variant_job(void *p_arg, int index)
+{
+	// Orientation bits are the map attributes shifted down by one: bit 0 rotates
+	// clockwise, then bit 1 mirrors Y and bit 2 mirrors X (see check_tile_rotate).
+	map_preview_job_t *p_job = (map_preview_job_t *)p_arg;
+	uint32_t tile_width = p_job->tile_width;
+	uint32_t tile_height = p_job->tile_height;
+	uint8_t *p_variant = p_job->p_variants[index];
+	
+	if (p_variant == NULL)
 		return;
-	}
 	
-	if (m_args.tile_y)
+	for (uint32_t t = 0; t < m_tile_count; t++)
 	{
-		// TODO implement Y order first maps
-		printf("Warning tilemap preview png implements only X order first maps.\n");
-		return;
+		for (uint32_t y = 0; y < tile_height; y++)
+		{
+			for (uint32_t x = 0; x < tile_width; x++)
+			{
+				uint32_t sx = (index & 4) ? tile_width - 1 - x : x;
+				uint32_t sy = (index & 2) ? tile_height - 1 - y : y;
+				uint32_t offset = (index & 1) ? (tile_height - 1 - sx) * tile_width + sy : sy * tile_width + sx;
+				
+				*p_variant++ = get_tile_pixel(t, offset);
+			}
+		}
 	}
+}
+
+static void map_preview_row_job(void *p_arg, int index)
+{
+	// Renders one row of map cells, blocks included, so rows never share pixels.
+	map_preview_job_t *p_job = (map_preview_job_t *)p_arg;
+	uint32_t tile_width = p_job->tile_width;
+	uint32_t tile_height = p_job->tile_height;
+	uint32_t tile_pixels = tile_width * tile_height;
 	
+	for (uint32_t cy = 0; cy < p_job->rows_per_cell; cy++)
+	{
+		uint32_t row = index * p_job->rows_per_cell + cy;
+		preview_cell_t *p_cell = &p_job->p_cells[row * p_job->cells_per_row];
+		
+		for (uint32_t cx = 0; cx < p_job->cells_per_row; cx++, p_cell++)
+		{
+			if (p_cell->tile >= m_tile_count)
+				continue;
+			
+			uint8_t *p_src = p_job->p_variants[p_cell->orientation] + p_cell->tile * tile_pixels;
+			uint8_t *p_dst = p_job->p_image + (row * tile_height) * p_job->png_width + cx * tile_width;
+			
+			for (uint32_t y = 0; y < tile_height; y++)
+			{
+				if (p_cell->palette)
+				{
+					for (uint32_t x = 0; x < tile_width; x++)
+						p_dst[x] = p_src[x] | p_cell->palette;
+				}
+				else
+				{
+					memcpy(p_dst, p_src, tile_width);
+				}
+				
+				p_src += tile_width;
+				p_dst += p_job->png_width;
+			}
+		}
+	}
+}
+
+static void write_map_png(char *png_filename, uint8_t *map, uint32_t map_bytes, uint32_t map_width, uint32_t map_height, uint32_t tile_width, uint32_t tile_height, uint32_t block_width, uint32_t block_height)
+{
+	// Cells are decoded to tile, orientation and palette offset first, each used
+	// orientation of the tileset is then built once and rows are blitted in parallel.
+	bool use_blocks = (block_width != 1 || block_height != 1);
 	uint16_t map_mask = m_args.map_16bit ? 0x1ff : 0xff;
-	uint16_t attribute_mask = m_args.map_16bit ? 0xfe00 : 0x0000;
-	uint8_t any_attribute = 0;
+	uint16_t block_mask = m_args.map_16bit ? 0x3ff : 0xff;
+	uint32_t tile_pixels = tile_width * tile_height;
 	
-	uint32_t pixels_per_byte = m_args.colors_4bit ? 2 : m_args.colors_1bit ? 8 : 1;
-	int pixel_shift = 8 / pixels_per_byte;
-	uint32_t tile_byte_width = m_tile_width / pixels_per_byte;
-	uint32_t tile_byte_size = m_tile_height * tile_byte_width;
-	uint8_t pixel_mask = (1 << pixel_shift) - 1;
+	map_preview_job_t job = { 0 };
+	job.cells_per_row = map_width * block_width;
+	job.rows_per_cell = block_height;
+	job.tile_width = tile_width;
+	job.tile_height = tile_height;
+	job.png_width = job.cells_per_row * tile_width;
 	
-	uint32_t png_width = map_width * tile_width * block_width;
-	uint32_t png_height = map_height * tile_height * block_height;
-	uint32_t png_size = png_width * png_height;
+	uint32_t png_height = map_height * block_height * tile_height;
+	uint32_t png_size = job.png_width * png_height;
 	
-	uint8_t *p_image = malloc(png_size);
+	job.p_cells = malloc(job.cells_per_row * map_height * block_height * sizeof(preview_cell_t));
+	job.p_image = calloc(png_size, 1);
 	
-	memset(p_image, 0, png_size);
+	if (job.p_cells == NULL || job.p_image == NULL)
+	{
+		exit_with_msg("Can't allocate memory for map preview.\n");
+	}
 	
-	for (uint32_t my = 0; my < map_height; ++my)
+	for (uint32_t my = 0; my < map_height; my++)
 	{
-		for (uint32_t mx = 0; mx < map_width; ++mx)
+		for (uint32_t mx = 0; mx < map_width; mx++)
 		{
-			uint16_t tile_data = 0;
-			memcpy(&tile_data, map + ((my * map_width + mx) * map_bytes), map_bytes);
-			uint16_t tile_id = tile_data & map_mask;
-			uint8_t attributes = (tile_data & attribute_mask) >> 8;
-			uint32_t src_offset = tile_id * tile_byte_size;
+			uint16_t value = 0;
+			memcpy(&value, map + get_map_cell_index(mx, my, map_width, map_height) * map_bytes, map_bytes);
 			
-			// TODO attributes are currently ignored, print warning when any is used
-			any_attribute |= attributes;
-			
-			// TODO non-1x1 block implementation somwhere here?
-			
-			for (uint32_t y = 0; y < tile_width; ++y)
+			for (uint32_t by = 0; by < block_height; by++)
 			{
-				uint32_t dst_offset = (my * tile_height * block_height + y) * png_width + (mx * tile_width * block_width);
-				
-				for (uint32_t x_byte = 0; x_byte < tile_byte_width; ++x_byte)
+				for (uint32_t bx = 0; bx < block_width; bx++)
 				{
-					uint8_t pixel = m_tiles[src_offset + y * tile_byte_width + x_byte];
+					preview_cell_t *p_cell = &job.p_cells[(my * block_height + by) * job.cells_per_row + mx * block_width + bx];
+					uint8_t attributes = 0;
+					
+					if (use_blocks)
+					{
+						// Block mirroring flips the tile order and the mirror bits of every tile.
+						uint32_t block_index = value & block_mask;
+						uint8_t mirror = (value >> 8) & 0x0c;
+						uint32_t sx = (mirror & 0x08) ? block_width - 1 - bx : bx;
+						uint32_t sy = (mirror & 0x04) ? block_height - 1 - by : by;
+						uint32_t i = block_index * m_block_size + sy * block_width + sx;
+						
+						p_cell->tile = (block_index < m_block_count ? m_blocks[i] : UINT32_MAX);
+						attributes = (block_index < m_block_count ? m_block_attributes[i] ^ mirror : 0);
+					}
+					else
+					{
+						p_cell->tile = ((value & map_mask) - m_args.tile_offset) & map_mask;
+						attributes = (m_args.map_16bit ? value >> 8 : 0);
+					}
+					
+					if (m_args.map_sms)
+					{
+						// SMS maps have H-flip in bit 1, V-flip in bit 2 and no rotate.
+						p_cell->orientation = ((attributes & 0x02) << 1) | (attributes & 0x04) >> 1;
+						p_cell->palette = 0;
+					}
+					else
+					{
+						p_cell->orientation = (attributes >> 1) & 7;
+						p_cell->palette = (m_args.colors_4bit ? attributes & 0xf0 : 0);
+					}
+					
+					if (tile_width != tile_height)
+					{
+						p_cell->orientation &= ~1;
+					}
 					
-					for (int shift = 8 - pixel_shift; 0 <= shift; shift -= pixel_shift)
+					if (p_cell->tile < m_tile_count)
 					{
-						p_image[dst_offset++] = (pixel >> shift) & pixel_mask;
+						job.orientations |= 1 << p_cell->orientation;
 					}
 				}
 			}
 		}
 	}
 	
-	if (any_attribute) // TODO implement attributes and remove this
+	for (int i = 0; i < 8; i++)
+	{
+		if (job.orientations & (1 << i))
+		{
+			job.p_variants[i] = malloc(m_tile_count * tile_pixels);
+			
+			if (job.p_variants[i] == NULL)
+			{
+				exit_with_msg("Can't allocate memory for map preview.\n");
+			}
+		}
+	}
+	
+	run_parallel(map_preview_variant_job, &job, 8);
+	run_parallel(map_preview_row_job, &job, map_height);
+	
+	write_png_bits(png_filename, job.p_image, job.png_width, png_height, false);
+	
+	for (int i = 0; i < 8; i++)
+		free(job.p_variants[i]);
+	
+	free(job.p_image);
+	free(job.p_cells);
+}
+
+static uint32_t rle_encode(uint8_t *p_dst, uint8_t *p_src, uint32_t size)
+{
+	// Control byte 0-127 is followed by 1-128 literal bytes, 128-254 repeats
+	// the next byte 3-129 times and 255 ends the data.
+	uint32_t dst_size = 0, literal_start = 0, i = 0;
+	
+	while (i <= size)
 	{
-		printf("Warning tilemap preview png ignores mirror/rotation attributes.\n");
+		uint32_t run = 1;
+		
+		while (i < size && i + run < size && p_src[i + run] == p_src[i] && run < 129)
+			run++;
+		
+		if (i == size || run >= 3 || i - literal_start == 128)
+		{
+			while (literal_start < i)
+			{
+				uint32_t count = MIN(i - literal_start, 128);
+				
+				p_dst[dst_size++] = count - 1;
+				memcpy(&p_dst[dst_size], &p_src[literal_start], count);
+				dst_size += count;
+				literal_start += count;
+			}
+		}
+		
+		if (i == size)
+			break;
+		
+		if (run >= 3)
+		{
+			p_dst[dst_size++] = run + 125;
+			p_dst[dst_size++] = p_src[i];
+			i += run;
+			literal_start = i;
+		}
+		else
+		{
+			i++;
+		}
 	}
 	
-	write_png_bits(png_filename, p_image, png_width, png_height, false);
+	p_dst[dst_size++] = 255;
 	
-	free(p_image);
+	return dst_size;
 }
 
-static void write_map(uint32_t image_width, uint32_t image_height, uint32_t tile_width, uint32_t tile_height, uint32_t block_width, uint32_t block_height)
+static uint32_t transform_map(uint8_t *p_dst, uint8_t *p_src, uint32_t map_size, uint32_t map_bytes, uint32_t line_length, uint8_t transform)
 {
-	char map_filename[256] = { 0 };
-	create_filename(map_filename, m_args.out_filename, EXT_NXM, m_args.compress & COMPRESS_MAP);
-	FILE *p_file = fopen(map_filename, "wb");
+	// The first byte is the transform tag. Decoding undoes RLE, then adds each
+	// row to the one above it, then interleaves the byte planes.
+	uint8_t *p_temp = malloc(map_size);
+	uint32_t cell_count = map_size / map_bytes;
+	uint32_t row_size = line_length * map_bytes;
 	
-	if (p_file == NULL)
+	if (p_temp == NULL)
+	{
+		exit_with_msg("Can't allocate memory for map transform.\n");
+	}
+	
+	if (transform & MAP_TRANSFORM_PLANES)
+	{
+		for (uint32_t i = 0; i < cell_count; i++)
+		{
+			p_temp[i] = p_src[i * 2];
+			p_temp[cell_count + i] = p_src[i * 2 + 1];
+		}
+		
+		row_size = line_length;
+	}
+	else
+	{
+		memcpy(p_temp, p_src, map_size);
+	}
+	
+	if (transform & MAP_TRANSFORM_DELTA)
+	{
+		// Each plane is cell_count bytes, or one plane of map_size bytes.
+		uint32_t plane_size = (transform & MAP_TRANSFORM_PLANES) ? cell_count : map_size;
+		
+		for (uint32_t plane = 0; plane < map_size; plane += plane_size)
+		{
+			for (uint32_t i = plane_size; i-- > row_size; )
+				p_temp[plane + i] -= p_temp[plane + i - row_size];
+		}
+	}
+	
+	p_dst[0] = transform;
+	
+	uint32_t size = 1;
+	
+	if (transform & MAP_TRANSFORM_RLE)
+	{
+		size += rle_encode(&p_dst[1], p_temp, map_size);
+	}
+	else
+	{
+		memcpy(&p_dst[1], p_temp, map_size);
+		size += map_size;
+	}
+	
+	free(p_temp);
+	
+	return size;
+}
+
+typedef struct
+{
+	uint8_t *p_map;
+	uint32_t map_size;
+	uint32_t map_bytes;
+	uint32_t line_length;
+	uint8_t *p_buffers[MAP_TRANSFORM_COUNT];
+	uint32_t sizes[MAP_TRANSFORM_COUNT];
+	size_t scores[MAP_TRANSFORM_COUNT];
+} map_transform_job_t;
+
+static void map_transform_job(void *p_arg, int index)
+{
+	map_transform_job_t *p_job = (map_transform_job_t *)p_arg;
+	
+	if ((index & MAP_TRANSFORM_PLANES) && p_job->map_bytes != 2)
 	{
-		exit_with_msg("Can't create file %s.\n", map_filename);
+		p_job->p_buffers[index] = NULL;
+		
+		return;
+	}
+	
+	// Worst case for RLE is one control byte per 128 bytes plus the end marker.
+	p_job->p_buffers[index] = malloc(p_job->map_size + p_job->map_size / 128 + 3);
+	
+	if (p_job->p_buffers[index] == NULL)
+	{
+		exit_with_msg("Can't allocate memory for map transform.\n");
+	}
+	
+	p_job->sizes[index] = transform_map(p_job->p_buffers[index], p_job->p_map, p_job->map_size, p_job->map_bytes, p_job->line_length, index);
+	p_job->scores[index] = (m_args.compress & COMPRESS_MAP) ? get_compressed_size_estimate(p_job->p_buffers[index], p_job->sizes[index], false) : p_job->sizes[index];
+}
+
+static void write_map_transformed(output_t *p_file, char *p_map_filename, uint8_t *p_map, uint32_t map_size, uint32_t map_bytes, uint32_t line_length)
+{
+	// Every combination of transforms is tried in parallel and the smallest
+	// result, compressed if the map is compressed, is written.
+	map_transform_job_t job = { p_map, map_size, map_bytes, line_length };
+	int best = 0;
+	
+	run_parallel(map_transform_job, &job, MAP_TRANSFORM_COUNT);
+	
+	for (int i = 1; i < MAP_TRANSFORM_COUNT; i++)
+	{
+		if (job.p_buffers[i] != NULL && job.scores[i] < job.scores[best])
+			best = i;
+	}
+	
+	static const char *p_transform_names[] = { "planes", "delta", "rle" };
+	char transform_name[32] = { 0 };
+	
+	for (int i = 0; i < 3; i++)
+	{
+		if (best & (1 << i))
+		{
+			if (transform_name[0] != '\0')
+				strcat(transform_name, "+");
+			
+			strcat(transform_name, p_transform_names[i]);
+		}
+	}
+	
+	printf("Map Transform = %s\n", best == 0 ? "none" : transform_name);
+	
+	write_file(p_file, p_map_filename, job.p_buffers[best], job.sizes[best], false, m_args.compress & COMPRESS_MAP);
+	
+	for (int i = 0; i < MAP_TRANSFORM_COUNT; i++)
+		free(job.p_buffers[i]);
+}
+
+static void write_map_chunks(output_t *p_file, char *p_map_filename, uint32_t map_width, uint32_t map_height, uint32_t map_bytes)
+{
+	// Chunks are stored one after the other, each compressed on its own, and a
+	// chunk that would cross a bank boundary starts at the next bank instead.
+	// The .nxc index has a 12 byte header (chunk width, chunk height, chunks
+	// across, chunks down and bank size as 16-bit values, bytes per cell and
+	// flags) followed by 6 bytes per chunk (bank, flags, offset in bank, size).
+	// The bank is a single byte, so the chunks have to fit in 256 banks.
+	uint32_t chunk_width = m_args.map_chunk_width;
+	uint32_t chunk_height = m_args.map_chunk_height;
+	uint32_t chunks_x = (map_width + chunk_width - 1) / chunk_width;
+	uint32_t chunks_y = (map_height + chunk_height - 1) / chunk_height;
+	uint32_t chunk_count = chunks_x * chunks_y;
+	uint32_t chunk_size = chunk_width * chunk_height * map_bytes;
+	uint32_t bank_size = (m_bank_size > 0 ? m_bank_size : SIZE_8K);
+	bool use_compression = m_args.compress & COMPRESS_MAP;
+	uint32_t index_size = 12 + chunk_count * 6;
+	uint32_t data_size = 0, data_capacity = bank_size;
+	uint8_t *p_chunk = malloc(chunk_size);
+	uint8_t *p_data = malloc(data_capacity);
+	uint8_t *p_index = malloc(index_size);
+	
+	if (p_chunk == NULL || p_data == NULL || p_index == NULL)
+	{
+		exit_with_msg("Can't allocate memory for map chunks.\n");
+	}
+	
+	if (chunk_size > bank_size || bank_size > 0xffff)
+	{
+		exit_with_msg("Map chunk size %d x %d doesn't fit in bank size %d.\n", chunk_width, chunk_height, bank_size);
+	}
+	
+	uint16_t header[5] = { chunk_width, chunk_height, chunks_x, chunks_y, bank_size };
+	
+	for (int i = 0; i < 5; i++)
+	{
+		p_index[i * 2] = header[i] & 0xff;
+		p_index[i * 2 + 1] = header[i] >> 8;
+	}
+	
+	p_index[10] = map_bytes;
+	p_index[11] = (use_compression ? 1 : 0) | (m_args.map_y ? 2 : 0);
+	
+	for (uint32_t c = 0; c < chunk_count; c++)
+	{
+		// Chunk rows first, or chunk columns first with -map-y.
+		uint32_t cx = (m_args.map_y ? c / chunks_y : c % chunks_x);
+		uint32_t cy = (m_args.map_y ? c % chunks_y : c / chunks_x);
+		uint8_t *p_offset = p_chunk;
+		
+		for (uint32_t i = 0; i < chunk_width * chunk_height; i++)
+		{
+			uint32_t x = cx * chunk_width + (m_args.map_y ? i / chunk_height : i % chunk_width);
+			uint32_t y = cy * chunk_height + (m_args.map_y ? i % chunk_height : i / chunk_width);
+			uint16_t tile = (x < map_width && y < map_height ? m_map[y * map_width + x] : 0);
+			
+			memcpy(p_offset, &tile, map_bytes);
+			p_offset += map_bytes;
+		}
+		
+		uint8_t *p_compressed = p_chunk;
+		size_t compressed_size = chunk_size;
+		bool backwards_mode = m_args.zx0_back;
+		
+		if (use_compression)
+		{
+			double start_ms = get_time_ms();
+			
+			p_compressed = compress_buffer(p_chunk, chunk_size, &compressed_size, &backwards_mode);
+			
+			stats_end(STAGE_COMPRESS, start_ms);
+			
+			if (m_args.zx0_verify)
+			{
+				verify_compression(p_map_filename, p_chunk, chunk_size, p_compressed, compressed_size, backwards_mode);
+			}
+			
+			m_stats.compress_in += chunk_size;
+			m_stats.compress_out += compressed_size;
+			
+			if (compressed_size > bank_size)
+			{
+				exit_with_msg("Compressed map chunk doesn't fit in bank size %d.\n", bank_size);
+			}
+		}
+		
+		uint32_t chunk_start = data_size;
+		
+		if (chunk_start % bank_size + compressed_size > bank_size)
+			chunk_start += bank_size - chunk_start % bank_size;
+		
+		if (chunk_start + compressed_size > data_capacity)
+		{
+			data_capacity = (chunk_start / bank_size + 2) * bank_size;
+			p_data = realloc(p_data, data_capacity);
+			
+			if (p_data == NULL)
+			{
+				exit_with_msg("Can't allocate memory for map chunks.\n");
+			}
+		}
+		
+		// Padding up to the next bank is zero.
+		memset(&p_data[data_size], 0, chunk_start - data_size);
+		data_size = chunk_start;
+		
+		uint8_t *p_entry = &p_index[12 + c * 6];
+		uint32_t offset = data_size % bank_size;
+		
+		if (data_size / bank_size > 0xff)
+		{
+			exit_with_msg("Map chunks don't fit in 256 banks of %d bytes.\n", bank_size);
+		}
+		
+		p_entry[0] = data_size / bank_size;
+		p_entry[1] = (use_compression && backwards_mode) ? 1 : 0;
+		p_entry[2] = offset & 0xff;
+		p_entry[3] = offset >> 8;
+		p_entry[4] = compressed_size & 0xff;
+		p_entry[5] = compressed_size >> 8;
+		
+		memcpy(&p_data[data_size], p_compressed, compressed_size);
+		data_size += compressed_size;
+		
+		if (p_compressed != p_chunk)
+			free(p_compressed);
 	}
 	
+	printf("Map Chunks = %d x %d (%d banks)\n", chunks_x, chunks_y, (data_size + bank_size - 1) / bank_size);
+	
+	write_file(p_file, p_map_filename, p_data, data_size, false, false);
+	
+	char index_filename[256] = { 0 };
+	create_filename(index_filename, m_args.out_filename, EXT_NXC, false);
+	
+	output_t *p_index_file = open_output(index_filename, false);
+	
+	write_file(p_index_file, index_filename, p_index, index_size, false, false);
+	
+	close_output(p_index_file);
+	
+	free(p_index);
+	free(p_data);
+	free(p_chunk);
+}
+
+static void write_map(uint32_t image_width, uint32_t image_height, uint32_t tile_width, uint32_t tile_height, uint32_t block_width, uint32_t block_height)
+{
+	char map_filename[256] = { 0 };
+	create_filename(map_filename, m_args.out_filename, EXT_NXM, m_args.compress & COMPRESS_MAP);
+	output_t *p_file = open_output(map_filename, false);
+	
 	uint32_t map_width = image_width / (tile_width * block_width);
 	uint32_t map_height = image_height / (tile_height * block_height);
 	uint32_t map_bytes = m_args.map_16bit ? 2 : 1;
@@ -3191,9 +5173,20 @@ static void write_map(uint32_t image_width, uint32_t image_height, uint32_t tile
 		}
 	}
 	
-	write_file(p_file, map_filename, p_buffer, map_size, m_args.map_16bit, m_args.compress & COMPRESS_MAP);
+	if (m_args.map_chunk_width > 0)
+	{
+		write_map_chunks(p_file, map_filename, map_width, map_height, map_bytes);
+	}
+	else if (m_args.map_transform)
+	{
+		write_map_transformed(p_file, map_filename, p_buffer, map_size, map_bytes, m_args.map_y ? map_height : map_width);
+	}
+	else
+	{
+		write_file(p_file, map_filename, p_buffer, map_size, m_args.map_16bit, m_args.compress & COMPRESS_MAP);
+	}
 	
-	fclose(p_file);
+	close_output(p_file);
 	
 	if (m_args.tiled_output)
 	{
@@ -3210,11 +5203,19 @@ static void write_map(uint32_t image_width, uint32_t image_height, uint32_t tile
 	free(p_buffer);
 }
 
+static uint32_t get_tile_byte_size(void)
+{
+	return m_args.colors_4bit ? (m_tile_size >> 1) : m_args.colors_1bit ? (m_tile_size >> 3) : m_tile_size;
+}
+
 static match_t check_tile(int i)
 {
-	uint32_t tile_byte_size = m_args.colors_4bit ? (m_tile_size >> 1) : m_args.colors_1bit ? (m_tile_size >> 3) : m_tile_size;
+	uint32_t tile_byte_size = get_tile_byte_size();
 	
 	int i_offset = i * tile_byte_size;
+	
+	m_stats.compare_calls++;
+	
 	int new_tile_offset = m_tile_count * tile_byte_size;
 	
 	return memcmp(m_tiles + i_offset, m_tiles + new_tile_offset, tile_byte_size) ? MATCH_NONE : MATCH_XY;
@@ -3226,6 +5227,8 @@ static match_t check_tile_rotate(int i)
 	match_t match_rot = MATCH_XY | MATCH_ROTATE | MATCH_MIRROR_Y | MATCH_MIRROR_X | MATCH_MIRROR_XY;
 	int tile_offset = i * m_tile_size;
 	
+	m_stats.compare_calls++;
+	
 	for (int y = 0; y < m_tile_height; y++)
 	{
 		for (int x = 0; x < m_tile_width; x++)
@@ -3324,241 +5327,1637 @@ static match_t check_tile_rotate(int i)
 	return match;
 }
 
-static int get_tile(int tx, int ty, uint8_t *attributes)
+static uint8_t get_tile_pixel(uint32_t tile_index, uint32_t offset)
 {
-	if (m_args.debug)
+	uint32_t ti = tile_index * m_tile_size + offset;
+	
+	if (m_args.colors_1bit)
 	{
-		printf("Tile Size = %d x %d\n", m_tile_width, m_tile_height);
-		printf("Image Size = %d x %d\n", m_image_width, m_image_height);
-		printf("Tile x = %04x, y = %04x\n", tx, ty);
+		return (m_tiles[ti >> 3] >> (7 - (ti & 7))) & 1;
+	}
+	else if (m_args.colors_4bit)
+	{
+		return (ti & 1 ? m_tiles[ti >> 1] & 0xf : m_tiles[ti >> 1] >> 4);
+	}
+	
+	return m_tiles[ti];
+}
+
+static void get_pixel_rgb(uint8_t pixel, float *rgb)
+{
+	if (m_args.colors_1bit)
+	{
+		rgb[0] = rgb[1] = rgb[2] = (pixel ? 255.0f : 0.0f);
+		return;
 	}
+	
+	rgb[0] = m_palette[pixel * 4 + 1];
+	rgb[1] = m_palette[pixel * 4 + 2];
+	rgb[2] = m_palette[pixel * 4 + 3];
+}
 
-	if (m_args.tile_ldws && !m_args.tile_y)
+static void create_palette_distance_table(void)
+{
+	// Euclidean RGB distance between every pair of palette colors.
+	for (int i = 0; i < NUM_PALETTE_COLORS; i++)
 	{
-		for (int x = 0; x < m_tile_width; x++)
+		float rgb_i[3];
+		
+		get_pixel_rgb(i, rgb_i);
+		
+		for (int j = 0; j < NUM_PALETTE_COLORS; j++)
 		{
-			if (m_args.debug)
+			float rgb_j[3];
+			
+			get_pixel_rgb(j, rgb_j);
+			
+			float dr = rgb_i[0] - rgb_j[0], dg = rgb_i[1] - rgb_j[1], db = rgb_i[2] - rgb_j[2];
+			
+			m_palette_distance[i][j] = sqrtf(dr * dr + dg * dg + db * db);
+		}
+	}
+}
+
+static float get_tile_distance(uint32_t tile1, uint32_t tile2, float max_total)
+{
+	// Sum of the palette distances between the pixels of two tiles. Gives up
+	// early once the sum goes over max_total.
+	float total = 0.0f;
+	
+	m_stats.compare_calls++;
+	
+	for (int i = 0; i < m_tile_size; i++)
+	{
+		total += m_palette_distance[get_tile_pixel(tile1, i)][get_tile_pixel(tile2, i)];
+		
+		if (total > max_total)
+			break;
+	}
+	
+	return total;
+}
+
+static void get_tile_grid_features(uint32_t tile_index, uint32_t grid_size, float *features)
+{
+	// Mean RGB color of each cell of a grid_size x grid_size grid over the tile.
+	uint32_t cell_width = MAX(m_tile_width / grid_size, 1);
+	uint32_t cell_height = MAX(m_tile_height / grid_size, 1);
+	uint32_t feature_count = grid_size * grid_size * 3;
+	uint32_t counts[TILE_REDUCE_GRID * TILE_REDUCE_GRID] = { 0 };
+	
+	memset(features, 0, feature_count * sizeof(float));
+	
+	for (int y = 0; y < m_tile_height; y++)
+	{
+		for (int x = 0; x < m_tile_width; x++)
+		{
+			int cell = MIN(y / cell_height, grid_size - 1) * grid_size + MIN(x / cell_width, grid_size - 1);
+			float rgb[3];
+			
+			get_pixel_rgb(get_tile_pixel(tile_index, y * m_tile_width + x), rgb);
+			
+			features[cell * 3 + 0] += rgb[0];
+			features[cell * 3 + 1] += rgb[1];
+			features[cell * 3 + 2] += rgb[2];
+			counts[cell]++;
+		}
+	}
+	
+	for (int i = 0; i < feature_count; i++)
+	{
+		if (counts[i / 3])
+			features[i] /= counts[i / 3];
+	}
+}
+
+static void get_tile_features(uint32_t tile_index, float *features)
+{
+	get_tile_grid_features(tile_index, 2, features);
+}
+
+static uint32_t get_merge_key(int table, const float *features)
+{
+	// p-stable LSH: quantized random projections of the tile features, hashed
+	// together into one bucket key per table.
+	uint32_t key = 2166136261u;
+	
+	for (int p = 0; p < TILE_MERGE_PROJECTIONS; p++)
+	{
+		const float *projection = m_merge_projections[table][p];
+		float dot = projection[TILE_FEATURE_COUNT];
+		
+		for (int i = 0; i < TILE_FEATURE_COUNT; i++)
+			dot += projection[i] * features[i];
+		
+		int32_t cell = (int32_t) floorf(dot / m_merge_width);
+		
+		key = (key ^ (uint32_t) cell) * 16777619u;
+	}
+	
+	return key;
+}
+
+static void merge_index_add(uint32_t tile_index)
+{
+	if (tile_index >= m_merge_capacity)
+	{
+		m_merge_capacity = MAX(m_merge_capacity * 2, 1024);
+		m_merge_features = realloc(m_merge_features, m_merge_capacity * TILE_FEATURE_COUNT * sizeof(float));
+		m_merge_next = realloc(m_merge_next, m_merge_capacity * TILE_MERGE_TABLES * sizeof(uint32_t));
+		m_merge_stamp = realloc(m_merge_stamp, m_merge_capacity * sizeof(uint32_t));
+		
+		if (m_merge_features == NULL || m_merge_next == NULL || m_merge_stamp == NULL)
+		{
+			exit_with_msg("Can't allocate memory for tile merge index.\n");
+		}
+	}
+	
+	float *features = &m_merge_features[tile_index * TILE_FEATURE_COUNT];
+	
+	get_tile_features(tile_index, features);
+	
+	m_merge_stamp[tile_index] = 0;
+	
+	for (int t = 0; t < TILE_MERGE_TABLES; t++)
+	{
+		uint32_t bucket = get_merge_key(t, features) & (TILE_MERGE_BUCKETS - 1);
+		
+		m_merge_next[tile_index * TILE_MERGE_TABLES + t] = m_merge_buckets[t][bucket];
+		m_merge_buckets[t][bucket] = tile_index + 1;
+	}
+}
+
+static void merge_index_init(void)
+{
+	// Fixed seed so the projections, and therefore the output, are repeatable.
+	uint32_t seed = 0x5eed1234;
+	
+	for (int t = 0; t < TILE_MERGE_TABLES; t++)
+	{
+		for (int p = 0; p < TILE_MERGE_PROJECTIONS; p++)
+		{
+			for (int i = 0; i <= TILE_FEATURE_COUNT; i++)
+			{
+				// Box-Muller for gaussian projections, uniform offset in [0, 1).
+				seed = seed * 1103515245 + 12345;
+				float u1 = ((seed >> 8) + 1.0f) / 16777217.0f;
+				seed = seed * 1103515245 + 12345;
+				float u2 = (seed >> 8) / 16777216.0f;
+				
+				m_merge_projections[t][p][i] = (i < TILE_FEATURE_COUNT ? sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2) : u2);
+			}
+		}
+	}
+	
+	// Feature distance of two tiles is at most four times their mean pixel
+	// distance, so buckets this wide keep near tiles together most of the time.
+	m_merge_width = 8.0f * m_args.tile_merge + 8.0f;
+	
+	for (int t = 0; t < TILE_MERGE_TABLES; t++)
+	{
+		for (int p = 0; p < TILE_MERGE_PROJECTIONS; p++)
+			m_merge_projections[t][p][TILE_FEATURE_COUNT] *= m_merge_width;
+	}
+	
+	memset(m_merge_buckets, 0, sizeof(m_merge_buckets));
+	
+	// Tiles kept from earlier files (-tile-shared) are merge candidates too.
+	for (int i = 0; i < m_tile_count; i++)
+		merge_index_add(i);
+	
+	m_merge_count = 0;
+	m_merge_error = 0.0;
+	m_merge_max_error = 0.0f;
+	
+	create_palette_distance_table();
+	
+	for (int i = 0; i < m_tile_count; i++)
+		merge_index_add(i);
+}
+
+static int find_merge_tile(uint32_t tile_index, float *error)
+{
+	float features[TILE_FEATURE_COUNT];
+	float max_total = (float) m_args.tile_merge * m_tile_size;
+	float best_total = max_total;
+	int best_index = -1;
+	
+	get_tile_features(tile_index, features);
+	
+	m_merge_stamp_value++;
+	
+	for (int t = 0; t < TILE_MERGE_TABLES; t++)
+	{
+		uint32_t bucket = get_merge_key(t, features) & (TILE_MERGE_BUCKETS - 1);
+		
+		m_stats.hash_probes++;
+		
+		for (uint32_t i = m_merge_buckets[t][bucket]; i != 0; i = m_merge_next[(i - 1) * TILE_MERGE_TABLES + t])
+		{
+			uint32_t candidate = i - 1;
+			
+			if (m_merge_stamp[candidate] == m_merge_stamp_value)
+				continue;
+			
+			m_merge_stamp[candidate] = m_merge_stamp_value;
+			
+			float total = get_tile_distance(candidate, tile_index, best_total);
+			
+			if (total < best_total || (total == best_total && best_index == -1))
+			{
+				best_total = total;
+				best_index = candidate;
+			}
+		}
+	}
+	
+	*error = best_total / m_tile_size;
+	
+	return best_index;
+}
+
+static int get_tile_orientations(void)
+{
+	// Number of orientations (of the rotate/mirror group) matched by the current
+	// mode, or 0 when the matching can't be expressed as a canonical key.
+	if (m_args.tile_norotate && !m_args.tile_nomirror)
+	{
+		return (m_tile_width == m_tile_height && !m_args.colors_1bit) ? 8 : 0;
+	}
+	
+	if (m_args.tile_norotate || m_args.tile_nomirror)
+	{
+		return m_args.colors_1bit ? 0 : 4;
+	}
+	
+	return 1;
+}
+
+static uint32_t get_tile_key(uint32_t tile_index, int orientations, uint8_t *p_orientation)
+{
+	// FNV-1a hash of the tile, the smallest over all orientations, so tiles
+	// that match each other mirrored or rotated share the same key.
+	uint32_t key = 0xffffffff;
+	
+	if (p_orientation != NULL)
+		*p_orientation = 0;
+	
+	if (orientations == 1)
+	{
+		uint32_t tile_byte_size = get_tile_byte_size();
+		uint8_t *p_tile = &m_tiles[tile_index * tile_byte_size];
+		
+		key = 2166136261u;
+		
+		for (int i = 0; i < tile_byte_size; i++)
+			key = (key ^ p_tile[i]) * 16777619u;
+		
+		return key;
+	}
+	
+	for (int o = 0; o < orientations; o++)
+	{
+		uint32_t hash = 2166136261u;
+		
+		for (int y = 0; y < m_tile_height; y++)
+		{
+			for (int x = 0; x < m_tile_width; x++)
+			{
+				int sy = (o & 2) ? m_tile_height - 1 - y : y;
+				int sx = (o & 1) ? m_tile_width - 1 - x : x;
+				int offset = (o & 4) ? sx * m_tile_width + sy : sy * m_tile_width + sx;
+				
+				hash = (hash ^ get_tile_pixel(tile_index, offset)) * 16777619u;
+			}
+		}
+		
+		if (hash < key)
+		{
+			key = hash;
+			
+			if (p_orientation != NULL)
+				*p_orientation = o;
+		}
+	}
+	
+	return key;
+}
+
+static void tile_hash_add(uint32_t tile_index, uint32_t key)
+{
+	if (tile_index >= m_tile_hash_capacity)
+	{
+		m_tile_hash_capacity = MAX(m_tile_hash_capacity * 2, 1024);
+		m_tile_hash_next = realloc(m_tile_hash_next, m_tile_hash_capacity * sizeof(int32_t));
+		m_tile_hash_keys = realloc(m_tile_hash_keys, m_tile_hash_capacity * sizeof(uint32_t));
+		
+		if (m_tile_hash_next == NULL || m_tile_hash_keys == NULL)
+		{
+			exit_with_msg("Can't allocate memory for tile hash index.\n");
+		}
+	}
+	
+	// Append so the chains stay in tile order and the first match is the lowest index.
+	uint32_t bucket = key & (TILE_HASH_BUCKETS - 1);
+	
+	m_tile_hash_keys[tile_index] = key;
+	m_tile_hash_next[tile_index] = -1;
+	
+	if (m_tile_hash_tail[bucket] == -1)
+		m_tile_hash_head[bucket] = tile_index;
+	else
+		m_tile_hash_next[m_tile_hash_tail[bucket]] = tile_index;
+	
+	m_tile_hash_tail[bucket] = tile_index;
+	m_tile_hash_count = tile_index + 1;
+}
+
+static void tile_hash_init(int orientations)
+{
+	for (int i = 0; i < TILE_HASH_BUCKETS; i++)
+	{
+		m_tile_hash_head[i] = -1;
+		m_tile_hash_tail[i] = -1;
+	}
+	
+	m_tile_hash_count = 0;
+	
+	for (int i = 0; i < m_tile_count; i++)
+		tile_hash_add(i, get_tile_key(i, orientations, NULL));
+	
+	m_tile_hash_init = true;
+}
+
+static bool check_tile_db_index(void)
+{
+	// Every link must be a tile of the same bucket further down, which also rules
+	// out cycles, and every tile must be linked exactly once.
+	uint8_t *p_linked = calloc(m_tile_count + 1, 1);
+	bool valid = (p_linked != NULL);
+	
+	for (int i = 0; i < TILE_HASH_BUCKETS && valid; i++)
+	{
+		int32_t head = m_tile_hash_head[i];
+		
+		if (head == -1)
+			continue;
+		
+		valid = (head >= 0 && head < (int32_t)m_tile_count && (m_tile_hash_keys[head] & (TILE_HASH_BUCKETS - 1)) == i && !p_linked[head]);
+		
+		if (valid)
+			p_linked[head] = 1;
+	}
+	
+	for (int32_t i = 0; i < (int32_t)m_tile_count && valid; i++)
+	{
+		int32_t next = m_tile_hash_next[i];
+		
+		if (next == -1)
+			continue;
+		
+		valid = (next > i && next < (int32_t)m_tile_count && !p_linked[next] &&
+			(m_tile_hash_keys[next] & (TILE_HASH_BUCKETS - 1)) == (m_tile_hash_keys[i] & (TILE_HASH_BUCKETS - 1)));
+		
+		if (valid)
+			p_linked[next] = 1;
+	}
+	
+	for (uint32_t i = 0; i < m_tile_count && valid; i++)
+		valid = p_linked[i];
+	
+	free(p_linked);
+	
+	return valid;
+}
+
+static void load_tile_db(void)
+{
+	// The database is mapped read only and its tiles copied to the start of the
+	// tileset. When it was indexed with the current matching mode the stored hash
+	// index is used as is, otherwise it is rebuilt on the first tile lookup.
+	// The previous file of a -tile-db series may still be queued for writing.
+	flush_outputs();
+	
+	int fd = open(m_args.tile_db, O_RDONLY);
+	
+	m_tile_db_count = 0;
+	m_tile_db_orientations = 0;
+	m_tile_db_index_offset = 0;
+	
+	if (fd == -1)
+	{
+		printf("Tile Database = %s (new)\n", m_args.tile_db);
+		return;
+	}
+	
+	struct stat st;
+	
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(tile_db_header_t))
+	{
+		exit_with_msg("Can't read tile database %s.\n", m_args.tile_db);
+	}
+	
+	uint8_t *p_db = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	
+	close(fd);
+	
+	if (p_db == MAP_FAILED)
+	{
+		exit_with_msg("Can't map tile database %s.\n", m_args.tile_db);
+	}
+	
+	tile_db_header_t *p_header = (tile_db_header_t *)p_db;
+	uint32_t tile_byte_size = get_tile_byte_size();
+	uint8_t bits = m_args.colors_1bit ? 1 : m_args.colors_4bit ? 4 : 8;
+	
+	if (memcmp(p_header->magic, TILE_DB_MAGIC, 4) || p_header->version != TILE_DB_VERSION)
+	{
+		exit_with_msg("Tile database %s has an unknown format.\n", m_args.tile_db);
+	}
+	
+	if (p_header->tile_width != m_tile_width || p_header->tile_height != m_tile_height || p_header->bits != bits)
+	{
+		exit_with_msg("Tile database %s has %d x %d tiles with %d bit colors.\n", m_args.tile_db, p_header->tile_width, p_header->tile_height, p_header->bits);
+	}
+	
+	uint64_t records_end = sizeof(tile_db_header_t) + (uint64_t)p_header->tile_count * p_header->record_size;
+	uint64_t index_size = (p_header->index_offset ? ((uint64_t)p_header->bucket_count + p_header->tile_count) * sizeof(int32_t) : 0);
+	
+	if (p_header->record_size != TILE_DB_RECORD_HEADER + tile_byte_size || records_end > st.st_size ||
+		(p_header->index_offset && (p_header->index_offset < records_end || p_header->index_offset + index_size > st.st_size)) ||
+		((uint64_t)p_header->tile_count + 1) * tile_byte_size > TILES_SIZE)
+	{
+		exit_with_msg("Tile database %s is corrupt.\n", m_args.tile_db);
+	}
+	
+	uint8_t *p_record = p_db + sizeof(tile_db_header_t);
+	
+	for (int i = 0; i < p_header->tile_count; i++, p_record += p_header->record_size)
+	{
+		memcpy(&m_tiles[i * tile_byte_size], p_record + TILE_DB_RECORD_HEADER, tile_byte_size);
+	}
+	
+	m_tile_count = p_header->tile_count;
+	m_tile_db_count = p_header->tile_count;
+	m_tile_db_orientations = p_header->orientations;
+	m_tile_db_index_offset = (p_header->index_offset ? p_header->index_offset : records_end);
+	m_tile_hash_init = false;
+	
+	int orientations = get_tile_orientations();
+	
+	if (p_header->index_offset && orientations > 0 && p_header->orientations == orientations && p_header->bucket_count == TILE_HASH_BUCKETS)
+	{
+		int32_t *p_heads = (int32_t *)(p_db + p_header->index_offset);
+		int32_t *p_next = p_heads + p_header->bucket_count;
+		
+		m_tile_hash_count = 0;
+		
+		if (m_tile_count > m_tile_hash_capacity)
+		{
+			m_tile_hash_capacity = m_tile_count;
+			m_tile_hash_next = realloc(m_tile_hash_next, m_tile_hash_capacity * sizeof(int32_t));
+			m_tile_hash_keys = realloc(m_tile_hash_keys, m_tile_hash_capacity * sizeof(uint32_t));
+			
+			if (m_tile_hash_next == NULL || m_tile_hash_keys == NULL)
+			{
+				exit_with_msg("Can't allocate memory for tile hash index.\n");
+			}
+		}
+		
+		memcpy(m_tile_hash_head, p_heads, TILE_HASH_BUCKETS * sizeof(int32_t));
+		memcpy(m_tile_hash_next, p_next, m_tile_count * sizeof(int32_t));
+		
+		for (int i = 0; i < TILE_HASH_BUCKETS; i++)
+			m_tile_hash_tail[i] = -1;
+		
+		p_record = p_db + sizeof(tile_db_header_t);
+		
+		for (int i = 0; i < m_tile_count; i++, p_record += p_header->record_size)
+		{
+			memcpy(&m_tile_hash_keys[i], p_record, sizeof(uint32_t));
+			
+			// Chains are in tile order so the last tile of a bucket is its tail.
+			m_tile_hash_tail[m_tile_hash_keys[i] & (TILE_HASH_BUCKETS - 1)] = i;
+		}
+		
+		if (check_tile_db_index())
+		{
+			m_tile_hash_count = m_tile_count;
+			m_tile_hash_init = true;
+		}
+		else
+		{
+			printf("Warning tile database %s has a bad index, rebuilding it.\n", m_args.tile_db);
+			
+			m_tile_db_index_offset = 0;
+		}
+	}
+	
+	munmap(p_db, st.st_size);
+	
+	printf("Tile Database = %s (%d tiles)\n", m_args.tile_db, m_tile_db_count);
+}
+
+static void write_tile_db_record(output_t *p_file, uint32_t tile_index, int orientations)
+{
+	uint32_t tile_byte_size = get_tile_byte_size();
+	uint8_t record[TILE_DB_RECORD_HEADER] = { 0 };
+	uint8_t orientation = 0;
+	uint32_t key = (orientations > 0 ? get_tile_key(tile_index, orientations, &orientation) : 0);
+	
+	memcpy(record, &key, sizeof(uint32_t));
+	record[4] = orientation;
+	
+	write_output(p_file, record, TILE_DB_RECORD_HEADER);
+	write_output(p_file, &m_tiles[tile_index * tile_byte_size], tile_byte_size);
+}
+
+static void save_tile_db(void)
+{
+	// Layout: header, one record per tile (hash key, canonical orientation, tile
+	// data), then the hash index (bucket heads and next links). The file is built
+	// in memory and replaced as a whole by the output thread, so a run that dies
+	// part way leaves the previous database intact.
+	int orientations = get_tile_orientations();
+	bool rewrite = (m_tile_db_index_offset == 0 || m_tile_db_orientations != orientations);
+	
+	if (m_tile_count == m_tile_db_count && !rewrite)
+		return;
+	
+	uint32_t tile_byte_size = get_tile_byte_size();
+	uint32_t record_size = TILE_DB_RECORD_HEADER + tile_byte_size;
+	tile_db_header_t header = { { 0 } };
+	output_t *p_file = open_output(m_args.tile_db, false);
+	
+	// The header is filled in below once the index offset is known.
+	write_output(p_file, &header, sizeof(header));
+	
+	for (int i = 0; i < m_tile_count; i++)
+		write_tile_db_record(p_file, i, orientations);
+	
+	
+	memcpy(header.magic, TILE_DB_MAGIC, 4);
+	header.version = TILE_DB_VERSION;
+	header.bits = m_args.colors_1bit ? 1 : m_args.colors_4bit ? 4 : 8;
+	header.orientations = orientations;
+	header.tile_width = m_tile_width;
+	header.tile_height = m_tile_height;
+	header.tile_count = m_tile_count;
+	header.record_size = record_size;
+	
+	if (orientations > 0)
+	{
+		if (!m_tile_hash_init || m_tile_hash_count != m_tile_count)
+			tile_hash_init(orientations);
+		
+		header.bucket_count = TILE_HASH_BUCKETS;
+		header.index_offset = sizeof(tile_db_header_t) + m_tile_count * record_size;
+		
+		write_output(p_file, m_tile_hash_head, TILE_HASH_BUCKETS * sizeof(int32_t));
+		write_output(p_file, m_tile_hash_next, m_tile_count * sizeof(int32_t));
+	}
+	
+	memcpy(p_file->p_data, &header, sizeof(header));
+	
+	close_output(p_file);
+	
+	printf("Tile Database = %s (%d new tiles)\n", m_args.tile_db, m_tile_count - m_tile_db_count);
+	
+	m_tile_db_count = m_tile_count;
+	m_tile_db_orientations = orientations;
+	m_tile_db_index_offset = header.index_offset;
+}
+
+static int get_tile(int tx, int ty, uint8_t *attributes)
+{
+	if (m_args.debug)
+	{
+		printf("Tile Size = %d x %d\n", m_tile_width, m_tile_height);
+		printf("Image Size = %d x %d\n", m_image_width, m_image_height);
+		printf("Tile x = %04x, y = %04x\n", tx, ty);
+	}
+	
+	m_stats.tiles_scanned++;
+
+	if (m_args.tile_ldws && !m_args.tile_y)
+	{
+		for (int x = 0; x < m_tile_width; x++)
+		{
+			if (m_args.debug)
 				printf("\n%04x: ", x);
 			
-			for (int y = 0; y < m_tile_height; y++)
+			for (int y = 0; y < m_tile_height; y++)
+			{
+				int tile_size = m_tile_size * m_tile_count;
+				int ti = tile_size + y * m_tile_width + x;
+				int px = tx + x, py = ty + y;
+				int index = py * m_image_width + px;
+				
+				if (px < 0 || px >= m_image_width || py < 0 || py >= m_image_height)
+					continue;
+				
+				uint8_t pix = m_next_image[index];
+				
+				if (m_args.debug)
+				{
+					printf("%02x ", pix);
+				}
+				
+				if (m_args.colors_1bit)
+				{
+					m_tiles[ti >> 3] <<= 1;
+					m_tiles[ti >> 3] |= pix ? 1 : 0;
+				}
+				else
+				if (m_args.colors_4bit)
+				{
+					if (ti & 1)
+					{
+						m_tiles[ti >> 1] |= (pix & 0xf);
+					}
+					else
+					{
+						m_tiles[ti >> 1] = (pix << 4) & 0xf0;
+					}
+					
+					if (m_chunk_size >> 4)
+					{
+						*attributes = (pix & 0xf0);
+					}
+				}
+				else
+				{
+					m_tiles[ti] = pix;
+				}
+			}
+		}
+	}
+	else
+	{
+		for (int y = 0; y < m_tile_height; y++)
+		{
+			if (m_args.debug)
+				printf("\n%04x: ", y);
+			for (int x = 0; x < m_tile_width; x++)
+			{
+				int tile_size = m_tile_size * m_tile_count;
+				int ti = tile_size + y * m_tile_width + x;
+				int px = tx + x, py = ty + y;
+				int index = py * m_image_width + px;
+				
+				if (px < 0 || px >= m_image_width || py < 0 || py >= m_image_height)
+					continue;
+				
+				uint8_t pix = m_next_image[index];
+				
+				if (m_args.debug)
+				{
+					printf("%02x ", pix);
+				}
+				
+				if (m_args.colors_1bit)
+				{
+					m_tiles[ti >> 3] <<= 1;
+					m_tiles[ti >> 3] |= pix ? 1 : 0;
+				}
+				else
+				if (m_args.colors_4bit)
+				{
+					if (ti & 1)
+					{
+						m_tiles[ti >> 1] |= (pix & 0xf);
+					}
+					else
+					{
+						m_tiles[ti >> 1] = (pix << 4) & 0xf0;
+					}
+
+					if (m_chunk_size >> 4)
+					{
+						*attributes = (pix & 0xf0);
+					}
+				}
+				else
+				{
+					m_tiles[ti] = pix;
+				}
+			}
+		}
+	}
+	
+	if (m_args.debug)
+		printf("\n");
+
+	uint32_t tile_index = m_tile_count;
+	match_t match = MATCH_NONE;
+	int orientations = get_tile_orientations();
+	uint32_t key = 0;
+	
+	if (m_args.tile_norepeat || m_args.tile_norotate || m_args.tile_nomirror)
+	{
+		bool rotate = (m_args.tile_norotate || m_args.tile_nomirror);
+		int match_index = -1;
+		
+		if (orientations > 0)
+		{
+			if (!m_tile_hash_init || m_tile_hash_count != m_tile_count)
+				tile_hash_init(orientations);
+			
+			key = get_tile_key(m_tile_count, orientations, NULL);
+			
+			m_stats.hash_probes++;
+			
+			for (int32_t i = m_tile_hash_head[key & (TILE_HASH_BUCKETS - 1)]; i != -1; i = m_tile_hash_next[i])
+			{
+				if (m_tile_hash_keys[i] != key)
+					continue;
+				
+				match = (rotate ? check_tile_rotate(i) : check_tile(i));
+				
+				if (match != MATCH_NONE)
+				{
+					match_index = i;
+					break;
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < m_tile_count; i++)
+			{
+				match = (rotate ? check_tile_rotate(i) : check_tile(i));
+				
+				if (match != MATCH_NONE)
+				{
+					match_index = i;
+					break;
+				}
+			}
+		}
+		
+		if (match != MATCH_NONE)
+		{
+			m_chunk_size = m_tile_size;
+			tile_index = match_index;
+			
+			if (rotate)
+			{
+				if (m_args.map_sms)
+				{
+					// H-flip differs from the next
+					*attributes |= (match >> 2) & 0x02;
+					// V-flip bit is the same as the Next
+					*attributes |= (match & 0x04);
+					// Note: there is no rotate on the SMS
+				}
+				else
+				{
+					*attributes |= (match & 0xe);
+				}
+			}
+		}
+	}
+	
+	if (match == MATCH_NONE && m_args.tile_merge >= 0)
+	{
+		float error = 0.0f;
+		int merge_index = find_merge_tile(m_tile_count, &error);
+		
+		if (merge_index != -1)
+		{
+			match = MATCH_XY;
+			tile_index = merge_index;
+			
+			m_merge_count++;
+			m_merge_error += error;
+			m_merge_max_error = MAX(m_merge_max_error, error);
+		}
+		else
+		{
+			merge_index_add(m_tile_count);
+		}
+	}
+	
+	if (match == MATCH_NONE)
+	{
+		if (orientations > 0 && m_tile_hash_init && (m_args.tile_norepeat || m_args.tile_norotate || m_args.tile_nomirror))
+			tile_hash_add(m_tile_count, key);
+		
+		m_tile_count++;
+	}
+	
+	*attributes |= m_args.tile_pal << 4;
+	
+	if (m_args.debug)
+		printf("Tile Index = %04x, Tile Count = %d\n", tile_index, m_tile_count);
+	
+	return tile_index;
+}
+
+static uint32_t get_block_hash(uint32_t block_index, uint8_t mirror)
+{
+	// FNV-1a over the tile indices of the block as seen with the given mirroring.
+	uint32_t hash = 2166136261u;
+	
+	for (int y = 0; y < m_block_height; y++)
+	{
+		for (int x = 0; x < m_block_width; x++)
+		{
+			int sx = (mirror & 0x08) ? m_block_width - 1 - x : x;
+			int sy = (mirror & 0x04) ? m_block_height - 1 - y : y;
+			uint16_t tile = m_blocks[block_index * m_block_size + sy * m_block_width + sx];
+			
+			hash = (hash ^ (tile & 0xff)) * 16777619u;
+			hash = (hash ^ (tile >> 8)) * 16777619u;
+		}
+	}
+	
+	return hash;
+}
+
+static bool check_block(uint32_t block_index, uint8_t mirror)
+{
+	// Compare the new block (at m_block_count) mirrored with a previous block. Mirrored
+	// matches also need each tile mirrored the same way so the block renders identically.
+	uint32_t new_index = m_block_count * m_block_size;
+	
+	m_stats.compare_calls++;
+	
+	for (int y = 0; y < m_block_height; y++)
+	{
+		for (int x = 0; x < m_block_width; x++)
+		{
+			int sx = (mirror & 0x08) ? m_block_width - 1 - x : x;
+			int sy = (mirror & 0x04) ? m_block_height - 1 - y : y;
+			uint32_t i = block_index * m_block_size + sy * m_block_width + sx;
+			uint32_t j = new_index + y * m_block_width + x;
+			
+			if (m_blocks[i] != m_blocks[j])
+				return false;
+			
+			if (mirror != 0 && (m_block_attributes[i] ^ mirror) != m_block_attributes[j])
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+static int get_block(int tbx, int tby, uint8_t *mirror)
+{
+	if (m_args.debug)
+		printf("\nBlock = %04x,%04x\n", tbx, tby);
+	
+	*mirror = 0;
+	
+	if (m_block_width == 1 && m_block_height == 1)
+	{
+		uint8_t attributes = 0;
+		return get_tile(tbx, tby, &attributes);
+	}
+	
+	for (int y = 0; y < m_block_height; y++)
+	{
+		for (int x = 0; x < m_block_width; x++)
+		{
+			uint8_t attributes = 0;
+			uint32_t block_offset = (m_block_count * m_block_width * m_block_height) + (y * m_block_width) + x;
+			m_blocks[block_offset] = get_tile(tbx + (x * m_tile_width), tby + (y * m_tile_height), &attributes);
+			m_block_attributes[block_offset] = attributes & 0x0e;
+		}
+	}
+	
+	uint32_t block_index = m_block_count;
+	bool found = false;
+	
+	if (!m_block_hash_init)
+	{
+		for (int i = 0; i < BLOCK_HASH_BUCKETS; i++)
+			m_block_hash[i] = -1;
+		
+		for (int i = 0; i < m_block_count; i++)
+		{
+			uint32_t bucket = get_block_hash(i, 0) & (BLOCK_HASH_BUCKETS - 1);
+			
+			m_block_next[i] = m_block_hash[bucket];
+			m_block_hash[bucket] = i;
+		}
+		
+		m_block_hash_init = true;
+	}
+	
+	if (m_args.block_norepeat)
+	{
+		// A block mirrored by M matches a previous block whose tiles, read mirrored by M,
+		// equal the new block, so look up the new block's own mirrored forms.
+		static const uint8_t mirrors[] = { 0x00, 0x08, 0x04, 0x0c };
+		int mirror_count = m_args.block_mirror ? 4 : 1;
+		
+		for (int m = 0; m < mirror_count && !found; m++)
+		{
+			uint32_t bucket = get_block_hash(m_block_count, mirrors[m]) & (BLOCK_HASH_BUCKETS - 1);
+			int32_t first = -1;
+			
+			m_stats.hash_probes++;
+			
+			// Chains are newest first, keep the earliest matching block like a linear search.
+			for (int32_t i = m_block_hash[bucket]; i != -1; i = m_block_next[i])
 			{
-				int tile_size = m_tile_size * m_tile_count;
-				int ti = tile_size + y * m_tile_width + x;
-				int px = tx + x, py = ty + y;
-				int index = py * m_image_width + px;
-				
-				if (px < 0 || px >= m_image_width || py < 0 || py >= m_image_height)
-					continue;
-				
-				uint8_t pix = m_next_image[index];
-				
-				if (m_args.debug)
+				if (check_block(i, mirrors[m]))
+					first = i;
+			}
+			
+			if (first != -1)
+			{
+				m_chunk_size = m_block_size;
+				block_index = first;
+				*mirror = mirrors[m];
+				found = true;
+			}
+		}
+	}
+	
+	if (!found)
+	{
+		if (m_args.debug)
+		{
+			printf("New Block %d =\n", m_block_count);
+			
+			for (int i = 0; i < m_block_height; i++)
+			{
+				for (int j = 0; j < m_block_width; j++)
 				{
-					printf("%02x ", pix);
+					printf("%02x ", m_blocks[m_block_count * (m_block_height * m_block_width) + (i * m_block_width) + j]);
 				}
 				
-				if (m_args.colors_1bit)
-				{
-					m_tiles[ti >> 3] <<= 1;
-					m_tiles[ti >> 3] |= pix ? 1 : 0;
-				}
-				else
-				if (m_args.colors_4bit)
-				{
-					if (ti & 1)
-					{
-						m_tiles[ti >> 1] |= (pix & 0xf);
-					}
-					else
-					{
-						m_tiles[ti >> 1] = (pix << 4) & 0xf0;
-					}
-					
-					if (m_chunk_size >> 4)
-					{
-						*attributes = (pix & 0xf0);
-					}
-				}
-				else
-				{
-					m_tiles[ti] = pix;
-				}
+				printf("\n");
 			}
 		}
+		
+		uint32_t bucket = get_block_hash(m_block_count, 0) & (BLOCK_HASH_BUCKETS - 1);
+		
+		m_block_next[m_block_count] = m_block_hash[bucket];
+		m_block_hash[bucket] = m_block_count;
+		m_block_count++;
+		
+		if (m_args.block_mirror && m_block_count > 0x200)
+		{
+			exit_with_msg("Block count %d exceeds 512 with -block-mirror.\n", m_block_count);
+		}
+	}
+	
+	return block_index;
+}
+
+static float get_feature_distance(const float *features1, const float *features2)
+{
+	float total = 0.0f;
+	
+	for (int i = 0; i < TILE_REDUCE_FEATURE_COUNT; i++)
+	{
+		float d = features1[i] - features2[i];
+		total += d * d;
+	}
+	
+	return sqrtf(total);
+}
+
+static void reduce_tiles(uint32_t target_count, uint32_t map_size)
+{
+	// Cluster the tiles into target_count groups with usage weighted k-means
+	// (k-means++ seeding and Hamerly's bounds so most distance calculations are
+	// skipped) over a downsampled color grid. Each group is then replaced by the
+	// member tile closest to its center and the map/blocks are remapped.
+	uint32_t tile_count = m_tile_count;
+	uint32_t tile_byte_size = get_tile_byte_size();
+	bool use_blocks = (m_block_width != 1 || m_block_height != 1);
+	float *features = malloc(tile_count * TILE_REDUCE_FEATURE_COUNT * sizeof(float));
+	float *centers = malloc(target_count * TILE_REDUCE_FEATURE_COUNT * sizeof(float));
+	double *center_sums = malloc(target_count * TILE_REDUCE_FEATURE_COUNT * sizeof(double));
+	double *center_weights = malloc(target_count * sizeof(double));
+	float *center_moves = malloc(target_count * sizeof(float));
+	float *center_spacing = malloc(target_count * sizeof(float));
+	float *upper = malloc(tile_count * sizeof(float));
+	float *lower = malloc(tile_count * sizeof(float));
+	float *nearest = malloc(tile_count * sizeof(float));
+	uint32_t *weights = calloc(tile_count, sizeof(uint32_t));
+	uint32_t *assignment = malloc(tile_count * sizeof(uint32_t));
+	int32_t *representative = malloc(target_count * sizeof(int32_t));
+	uint32_t *remap = malloc(tile_count * sizeof(uint32_t));
+	
+	if (!features || !centers || !center_sums || !center_weights || !center_moves || !center_spacing ||
+		!upper || !lower || !nearest || !weights || !assignment || !representative || !remap)
+	{
+		exit_with_msg("Can't allocate memory for tile reduction.\n");
+	}
+	
+	double start_ms = get_time_ms();
+	
+	for (int i = 0; i < tile_count; i++)
+		get_tile_grid_features(i, TILE_REDUCE_GRID, &features[i * TILE_REDUCE_FEATURE_COUNT]);
+	
+	// Tile usage as weights, so frequently used tiles keep their own group.
+	if (use_blocks)
+	{
+		for (int i = 0; i < m_block_count * m_block_size; i++)
+			weights[m_blocks[i]]++;
 	}
 	else
 	{
-		for (int y = 0; y < m_tile_height; y++)
+		for (int i = 0; i < map_size; i++)
+			weights[m_map_tiles[i]]++;
+	}
+	
+	for (int i = 0; i < tile_count; i++)
+		weights[i] = MAX(weights[i], 1);
+	
+	// k-means++ seeding: the most used tile first, then tiles picked with a
+	// probability proportional to weight times squared distance to the closest
+	// center so far. A fixed seed keeps the output repeatable.
+	uint32_t seed = 0x7e11ced5;
+	uint32_t first = 0;
+	
+	for (int i = 1; i < tile_count; i++)
+	{
+		if (weights[i] > weights[first])
+			first = i;
+	}
+	
+	memcpy(centers, &features[first * TILE_REDUCE_FEATURE_COUNT], TILE_REDUCE_FEATURE_COUNT * sizeof(float));
+	
+	for (int i = 0; i < tile_count; i++)
+	{
+		nearest[i] = get_feature_distance(&features[i * TILE_REDUCE_FEATURE_COUNT], centers);
+		assignment[i] = 0;
+	}
+	
+	for (int c = 1; c < target_count; c++)
+	{
+		double total = 0.0;
+		
+		for (int i = 0; i < tile_count; i++)
+			total += (double) weights[i] * nearest[i] * nearest[i];
+		
+		if (total <= 0.0)
 		{
-			if (m_args.debug)
-				printf("\n%04x: ", y);
-			for (int x = 0; x < m_tile_width; x++)
+			target_count = c;
+			break;
+		}
+		
+		seed = seed * 1103515245 + 12345;
+		double pick = total * ((seed >> 8) / 16777216.0);
+		uint32_t chosen = tile_count - 1;
+		
+		for (int i = 0; i < tile_count; i++)
+		{
+			pick -= (double) weights[i] * nearest[i] * nearest[i];
+			
+			if (pick < 0.0 && nearest[i] > 0.0f)
 			{
-				int tile_size = m_tile_size * m_tile_count;
-				int ti = tile_size + y * m_tile_width + x;
-				int px = tx + x, py = ty + y;
-				int index = py * m_image_width + px;
-				
-				if (px < 0 || px >= m_image_width || py < 0 || py >= m_image_height)
-					continue;
-				
-				uint8_t pix = m_next_image[index];
-				
-				if (m_args.debug)
-				{
-					printf("%02x ", pix);
-				}
+				chosen = i;
+				break;
+			}
+		}
+		
+		float *center = &centers[c * TILE_REDUCE_FEATURE_COUNT];
+		
+		memcpy(center, &features[chosen * TILE_REDUCE_FEATURE_COUNT], TILE_REDUCE_FEATURE_COUNT * sizeof(float));
+		
+		for (int i = 0; i < tile_count; i++)
+		{
+			float distance = get_feature_distance(&features[i * TILE_REDUCE_FEATURE_COUNT], center);
+			
+			if (distance < nearest[i])
+			{
+				nearest[i] = distance;
+				assignment[i] = c;
+			}
+		}
+	}
+	
+	// Hamerly bounds: upper is the distance to the assigned center, lower a
+	// bound on the distance to any other center.
+	for (int i = 0; i < tile_count; i++)
+	{
+		upper[i] = nearest[i];
+		lower[i] = 0.0f;
+	}
+	
+	for (int iteration = 0; iteration < TILE_REDUCE_ITERATIONS; iteration++)
+	{
+		// Move the centers to the weighted mean of their tiles.
+		memset(center_sums, 0, target_count * TILE_REDUCE_FEATURE_COUNT * sizeof(double));
+		memset(center_weights, 0, target_count * sizeof(double));
+		
+		for (int i = 0; i < tile_count; i++)
+		{
+			double *center_sum = &center_sums[assignment[i] * TILE_REDUCE_FEATURE_COUNT];
+			
+			for (int f = 0; f < TILE_REDUCE_FEATURE_COUNT; f++)
+				center_sum[f] += (double) weights[i] * features[i * TILE_REDUCE_FEATURE_COUNT + f];
+			
+			center_weights[assignment[i]] += weights[i];
+		}
+		
+		float max_move = 0.0f;
+		
+		for (int c = 0; c < target_count; c++)
+		{
+			float *center = &centers[c * TILE_REDUCE_FEATURE_COUNT];
+			float moved[TILE_REDUCE_FEATURE_COUNT];
+			
+			if (center_weights[c] == 0.0)
+			{
+				center_moves[c] = 0.0f;
+				continue;
+			}
+			
+			for (int f = 0; f < TILE_REDUCE_FEATURE_COUNT; f++)
+				moved[f] = (float) (center_sums[c * TILE_REDUCE_FEATURE_COUNT + f] / center_weights[c]);
+			
+			center_moves[c] = get_feature_distance(center, moved);
+			max_move = MAX(max_move, center_moves[c]);
+			
+			memcpy(center, moved, sizeof(moved));
+		}
+		
+		if (iteration > 0 && max_move == 0.0f)
+			break;
+		
+		for (int i = 0; i < tile_count; i++)
+		{
+			upper[i] += center_moves[assignment[i]];
+			lower[i] -= max_move;
+		}
+		
+		// Half the distance from each center to its closest other center.
+		for (int c = 0; c < target_count; c++)
+		{
+			float closest = FLT_MAX;
+			
+			for (int d = 0; d < target_count; d++)
+			{
+				if (d != c)
+					closest = MIN(closest, get_feature_distance(&centers[c * TILE_REDUCE_FEATURE_COUNT], &centers[d * TILE_REDUCE_FEATURE_COUNT]));
+			}
+			
+			center_spacing[c] = closest / 2.0f;
+		}
+		
+		uint32_t changes = 0;
+		
+		for (int i = 0; i < tile_count; i++)
+		{
+			float *feature = &features[i * TILE_REDUCE_FEATURE_COUNT];
+			float bound = MAX(center_spacing[assignment[i]], lower[i]);
+			
+			if (upper[i] <= bound)
+				continue;
+			
+			upper[i] = get_feature_distance(feature, &centers[assignment[i] * TILE_REDUCE_FEATURE_COUNT]);
+			
+			if (upper[i] <= bound)
+				continue;
+			
+			float best = FLT_MAX, second = FLT_MAX;
+			uint32_t best_center = assignment[i];
+			
+			for (int c = 0; c < target_count; c++)
+			{
+				float distance = get_feature_distance(feature, &centers[c * TILE_REDUCE_FEATURE_COUNT]);
 				
-				if (m_args.colors_1bit)
-				{
-					m_tiles[ti >> 3] <<= 1;
-					m_tiles[ti >> 3] |= pix ? 1 : 0;
-				}
-				else
-				if (m_args.colors_4bit)
+				if (distance < best)
 				{
-					if (ti & 1)
-					{
-						m_tiles[ti >> 1] |= (pix & 0xf);
-					}
-					else
-					{
-						m_tiles[ti >> 1] = (pix << 4) & 0xf0;
-					}
-
-					if (m_chunk_size >> 4)
-					{
-						*attributes = (pix & 0xf0);
-					}
+					second = best;
+					best = distance;
+					best_center = c;
 				}
-				else
+				else if (distance < second)
 				{
-					m_tiles[ti] = pix;
+					second = distance;
 				}
 			}
+			
+			if (best_center != assignment[i])
+				changes++;
+			
+			assignment[i] = best_center;
+			upper[i] = best;
+			lower[i] = second;
+		}
+		
+		if (changes == 0)
+			break;
+	}
+	
+	// Pick the tile closest to each center as its representative.
+	for (int c = 0; c < target_count; c++)
+	{
+		representative[c] = -1;
+		nearest[c] = FLT_MAX;
+	}
+	
+	for (int i = 0; i < tile_count; i++)
+	{
+		float distance = get_feature_distance(&features[i * TILE_REDUCE_FEATURE_COUNT], &centers[assignment[i] * TILE_REDUCE_FEATURE_COUNT]);
+		
+		if (distance < nearest[assignment[i]])
+		{
+			nearest[assignment[i]] = distance;
+			representative[assignment[i]] = i;
+		}
+	}
+	
+	// Measure the error before the tile data is moved.
+	double total_error = 0.0, total_weight = 0.0;
+	float max_error = 0.0f;
+	
+	create_palette_distance_table();
+	
+	for (int i = 0; i < tile_count; i++)
+	{
+		float error = get_tile_distance(representative[assignment[i]], i, FLT_MAX) / m_tile_size;
+		
+		total_error += (double) error * weights[i];
+		total_weight += weights[i];
+		max_error = MAX(max_error, error);
+	}
+	
+	// Compact the representatives in their original order.
+	uint32_t new_count = 0;
+	
+	for (int i = 0; i < tile_count; i++)
+	{
+		if (representative[assignment[i]] == i)
+		{
+			remap[i] = new_count;
+			
+			if (new_count != i)
+				memmove(&m_tiles[new_count * tile_byte_size], &m_tiles[i * tile_byte_size], tile_byte_size);
+			
+			new_count++;
+		}
+	}
+	
+	for (int i = 0; i < tile_count; i++)
+		remap[i] = remap[representative[assignment[i]]];
+	
+	if (use_blocks)
+	{
+		for (int i = 0; i < m_block_count * m_block_size; i++)
+			m_blocks[i] = remap[m_blocks[i]];
+		
+		m_block_hash_init = false;
+	}
+	else
+	{
+		uint16_t map_mask = (m_args.map_16bit ? 0x1ff : 0xff);
+		
+		for (int i = 0; i < map_size; i++)
+		{
+			m_map_tiles[i] = remap[m_map_tiles[i]];
+			m_map[i] = ((m_args.tile_offset + m_map_tiles[i]) & map_mask) | (m_map[i] & 0xfe00);
 		}
 	}
 	
-	if (m_args.debug)
-		printf("\n");
+	m_tile_count = new_count;
+	m_tile_hash_init = false;
+	
+	printf("Tile Reduce = %d tiles reduced to %d in %.1f ms (mean error %.2f, max error %.2f)\n", tile_count, new_count, get_time_ms() - start_ms, total_weight > 0.0 ? total_error / total_weight : 0.0, max_error);
+	
+	free(features);
+	free(centers);
+	free(center_sums);
+	free(center_weights);
+	free(center_moves);
+	free(center_spacing);
+	free(upper);
+	free(lower);
+	free(nearest);
+	free(weights);
+	free(assignment);
+	free(representative);
+	free(remap);
+}
 
-	uint32_t tile_index = m_tile_count;
-	match_t match = MATCH_NONE;
+typedef struct
+{
+	uint32_t *orders[TILE_ORDER_COUNT];
+	uint32_t *counts;
+	uint32_t map_width;
+	uint32_t map_height;
+	bool use_blocks;
+	size_t sizes[TILE_ORDER_COUNT];
+} tile_order_job_t;
+
+static void tile_order_job(void *p_arg, int index)
+{
+	// Estimated compressed size of the tiles and the map (or blocks) when the
+	// tiles are numbered in this order.
+	tile_order_job_t *p_job = (tile_order_job_t *)p_arg;
+	uint32_t *order = p_job->orders[index];
+	uint32_t tile_byte_size = get_tile_byte_size();
+	uint32_t map_bytes = (p_job->use_blocks ? (m_args.block_16bit ? 2 : 1) : (m_args.map_16bit ? 2 : 1));
+	uint32_t cell_count = (p_job->use_blocks ? m_block_count * m_block_size : p_job->map_width * p_job->map_height);
+	uint16_t map_mask = (m_args.map_16bit ? 0x1ff : 0xff);
+	uint8_t *p_tiles = malloc(m_tile_count * tile_byte_size);
+	uint8_t *p_map = malloc(cell_count * map_bytes);
+	uint32_t *remap = malloc(m_tile_count * sizeof(uint32_t));
 	
-	if (m_args.tile_norepeat || m_args.tile_norotate || m_args.tile_nomirror)
+	if (p_tiles == NULL || p_map == NULL || remap == NULL)
 	{
-		for (int i = 0; i < m_tile_count; i++)
-		{
-			match = ((m_args.tile_norotate || m_args.tile_nomirror) ? check_tile_rotate(i) : check_tile(i));
-			
-			if (match != MATCH_NONE)
-			{
-				m_chunk_size = m_tile_size;
-				tile_index = i;
-				
-				if (m_args.tile_norotate || m_args.tile_nomirror)
-				{
-					if (m_args.map_sms)
-					{
-						// H-flip differs from the next
-						*attributes |= (match >> 2) & 0x02;
-						// V-flip bit is the same as the Next
-						*attributes |= (match & 0x04);
-						// Note: there is no rotate on the SMS
-					}
-					else
-					{
-						*attributes |= (match & 0xe);
-					}
-				}
-				break;
-			}
-		}
+		exit_with_msg("Can't allocate memory for tile order.\n");
 	}
 	
-	if (match == MATCH_NONE)
+	for (uint32_t i = 0; i < m_tile_count; i++)
 	{
-		m_tile_count++;
+		memcpy(&p_tiles[i * tile_byte_size], &m_tiles[order[i] * tile_byte_size], tile_byte_size);
+		remap[order[i]] = i;
 	}
 	
-	*attributes |= m_args.tile_pal << 4;
+	for (uint32_t i = 0; i < cell_count; i++)
+	{
+		uint16_t value;
+		
+		if (p_job->use_blocks)
+		{
+			value = remap[m_blocks[i]];
+		}
+		else
+		{
+			// Cells in the order write_map() stores them.
+			uint32_t x = (m_args.map_y ? i / p_job->map_height : i % p_job->map_width);
+			uint32_t y = (m_args.map_y ? i % p_job->map_height : i / p_job->map_width);
+			uint32_t cell = y * p_job->map_width + x;
+			
+			value = ((m_args.tile_offset + remap[m_map_tiles[cell]]) & map_mask) | (m_map[cell] & 0xfe00);
+		}
+		
+		memcpy(&p_map[i * map_bytes], &value, map_bytes);
+	}
 	
-	if (m_args.debug)
-		printf("Tile Index = %04x, Tile Count = %d\n", tile_index, m_tile_count);
+	p_job->sizes[index] = zx0_estimate_greedy(p_tiles, m_tile_count * tile_byte_size, m_args.zx0_quick, m_args.zx0_back) +
+		zx0_estimate_greedy(p_map, cell_count * map_bytes, m_args.zx0_quick, m_args.zx0_back);
 	
-	return tile_index;
+	free(p_tiles);
+	free(p_map);
+	free(remap);
 }
 
-static int get_block(int tbx, int tby)
+static int compare_tile_order_key(const void *p1, const void *p2)
 {
-	if (m_args.debug)
-		printf("\nBlock = %04x,%04x\n", tbx, tby);
+	uint64_t key1 = *(const uint64_t *) p1;
+	uint64_t key2 = *(const uint64_t *) p2;
 	
-	if (m_block_width == 1 && m_block_height == 1)
+	return (key1 > key2) ? 1 : (key1 < key2) ? -1 : 0;
+}
+
+static uint32_t get_next_tile(uint32_t *counts, uint32_t *scores, bool *used, uint32_t tile_count)
+{
+	// Unused tile with the highest score, the most used one on a tie.
+	int32_t best = -1;
+	
+	for (uint32_t i = 0; i < tile_count; i++)
 	{
-		uint8_t attributes = 0;
-		return get_tile(tbx, tby, &attributes);
+		if (!used[i] && (best < 0 || scores[i] > scores[best] || (scores[i] == scores[best] && counts[i] > counts[best])))
+			best = i;
 	}
 	
-	for (int y = 0; y < m_block_height; y++)
+	return best;
+}
+
+static void order_tiles(uint32_t map_width, uint32_t map_height)
+{
+	// Candidate numberings: as found, most used first, chained by which tiles
+	// sit next to each other in the map, and chained by tile similarity. They
+	// are rated in parallel with the greedy zx0 estimate and the smallest wins.
+	static const char *p_order_names[TILE_ORDER_COUNT] = { "first seen", "frequency", "adjacency", "similarity" };
+	uint32_t tile_count = m_tile_count;
+	uint32_t tile_byte_size = get_tile_byte_size();
+	bool use_blocks = (m_block_width != 1 || m_block_height != 1);
+	uint32_t cell_count = (use_blocks ? m_block_count * m_block_size : map_width * map_height);
+	int order_count = TILE_ORDER_COUNT;
+	tile_order_job_t job = { { NULL }, NULL, map_width, map_height, use_blocks };
+	uint32_t *neighbour_start = calloc(tile_count + 1, sizeof(uint32_t));
+	uint32_t *neighbours = NULL;
+	uint64_t *keys = malloc(tile_count * sizeof(uint64_t));
+	uint32_t *scores = calloc(tile_count, sizeof(uint32_t));
+	bool *used = malloc(tile_count * sizeof(bool));
+	double start_ms = get_time_ms();
+	
+	job.counts = calloc(tile_count, sizeof(uint32_t));
+	
+	if (neighbour_start == NULL || keys == NULL || scores == NULL || used == NULL || job.counts == NULL)
+	{
+		exit_with_msg("Can't allocate memory for tile order.\n");
+	}
+	
+	// The similarity chain compares every tile with every unused one.
+	if (tile_count > TILE_ORDER_SIMILARITY_MAX)
+	{
+		order_count = TILE_ORDER_COUNT - 1;
+		
+		printf("Tile Order similarity skipped for %d tiles (limit %d)\n", tile_count, TILE_ORDER_SIMILARITY_MAX);
+	}
+	
+	for (int i = 0; i < order_count; i++)
 	{
-		for (int x = 0; x < m_block_width; x++)
+		if ((job.orders[i] = malloc(tile_count * sizeof(uint32_t))) == NULL)
 		{
-			uint8_t attributes = 0;
-			m_blocks[(m_block_count * m_block_width * m_block_height) + (y * m_block_width) + x] = get_tile(tbx + (x * m_tile_width), tby + (y * m_tile_height), &attributes);
+			exit_with_msg("Can't allocate memory for tile order.\n");
 		}
 	}
 	
-	uint32_t block_index = m_block_count;
-	bool found = false;
-	
-	if (m_args.block_norepeat)
+	// Per tile neighbour lists, one entry each way for every pair of horizontal
+	// neighbours in the map or consecutive tiles in a block, so at most two
+	// entries per cell. A neighbour is listed once per time it is seen.
+	for (int pass = 0; pass < 2; pass++)
 	{
-		for (int i = 0; i < m_block_count; i++)
+		for (uint32_t i = 1; i < cell_count; i++)
 		{
-			uint32_t block_size = m_block_width * m_block_height;
+			uint32_t tile = (use_blocks ? m_blocks[i] : m_map_tiles[i]);
+			uint32_t previous = (use_blocks ? m_blocks[i - 1] : m_map_tiles[i - 1]);
 			
-			found = true;
+			if (use_blocks ? i % m_block_size == 0 : i % map_width == 0)
+				continue;
 			
-			for (int j = 0; j < block_size; j++)
+			if (pass == 0)
 			{
-				if (m_blocks[i * block_size + j] != m_blocks[m_block_count * block_size + j])
-				{
-					found = false;
-					break;
-				}
+				neighbour_start[previous + 1]++;
+				neighbour_start[tile + 1]++;
+			}
+			else
+			{
+				neighbours[scores[previous]++] = tile;
+				neighbours[scores[tile]++] = previous;
+			}
+		}
+		
+		if (pass == 0)
+		{
+			for (uint32_t i = 0; i < tile_count; i++)
+			{
+				neighbour_start[i + 1] += neighbour_start[i];
+				scores[i] = neighbour_start[i];
 			}
 			
-			if (found)
+			if ((neighbours = malloc(MAX(neighbour_start[tile_count], 1) * sizeof(uint32_t))) == NULL)
 			{
-				m_chunk_size = block_size;
-				block_index = i;
-				break;
+				exit_with_msg("Can't allocate memory for tile order.\n");
 			}
 		}
 	}
 	
-	if (!found)
+	for (uint32_t i = 0; i < cell_count; i++)
+		job.counts[use_blocks ? m_blocks[i] : m_map_tiles[i]]++;
+	
+	for (uint32_t i = 0; i < tile_count; i++)
 	{
-		if (m_args.debug)
+		job.orders[0][i] = i;
+		keys[i] = ((uint64_t) (UINT32_MAX - job.counts[i]) << 32) | i;
+	}
+	
+	// Most used first, the first seen on a tie.
+	qsort(keys, tile_count, sizeof(uint64_t), compare_tile_order_key);
+	
+	for (uint32_t i = 0; i < tile_count; i++)
+		job.orders[1][i] = (uint32_t) keys[i];
+	
+	// Adjacency chain: the unused neighbour of the last tile seen next to it
+	// most often, else the most used unused tile.
+	memset(used, 0, tile_count * sizeof(bool));
+	memset(scores, 0, tile_count * sizeof(uint32_t));
+	
+	for (uint32_t i = 0, tile = 0, next_used = 0; i < tile_count; i++)
+	{
+		int32_t best = -1;
+		
+		if (i > 0)
 		{
-			printf("New Block %d =\n", m_block_count);
+			for (uint32_t j = neighbour_start[tile]; j < neighbour_start[tile + 1]; j++)
+				scores[neighbours[j]]++;
 			
-			for (int i = 0; i < m_block_height; i++)
+			for (uint32_t j = neighbour_start[tile]; j < neighbour_start[tile + 1]; j++)
 			{
-				for (int j = 0; j < m_block_width; j++)
+				uint32_t other = neighbours[j];
+				
+				if (!used[other] && (best < 0 || scores[other] > scores[best] || (scores[other] == scores[best] && (job.counts[other] > job.counts[best] || (job.counts[other] == job.counts[best] && other < (uint32_t) best)))))
+					best = other;
+			}
+			
+			for (uint32_t j = neighbour_start[tile]; j < neighbour_start[tile + 1]; j++)
+				scores[neighbours[j]] = 0;
+		}
+		
+		if (best < 0)
+		{
+			while (used[job.orders[1][next_used]])
+				next_used++;
+			
+			best = job.orders[1][next_used];
+		}
+		
+		tile = best;
+		used[tile] = true;
+		job.orders[2][i] = tile;
+	}
+	
+	if (order_count > 3)
+	{
+		uint32_t tile = 0;
+		
+		memset(used, 0, tile_count * sizeof(bool));
+		
+		for (uint32_t i = 0; i < tile_count; i++)
+		{
+			if (i > 0)
+			{
+				uint8_t *p_tile = &m_tiles[tile * tile_byte_size];
+				
+				for (uint32_t j = 0; j < tile_count; j++)
 				{
-					printf("%02x ", m_blocks[m_block_count * (m_block_height * m_block_width) + (i * m_block_width) + j]);
+					uint8_t *p_other = &m_tiles[j * tile_byte_size];
+					uint32_t same = 0;
+					
+					if (used[j])
+						continue;
+					
+					for (uint32_t k = 0; k < tile_byte_size; k++)
+						same += (p_tile[k] == p_other[k]);
+					
+					scores[j] = same;
 				}
-				
-				printf("\n");
 			}
+			
+			// The similarity chain starts from the first tile.
+			tile = (i == 0 ? 0 : get_next_tile(job.counts, scores, used, tile_count));
+			used[tile] = true;
+			job.orders[3][i] = tile;
+		}
+	}
+	
+	run_parallel(tile_order_job, &job, order_count);
+	
+	int best = 0;
+	
+	for (int i = 1; i < order_count; i++)
+	{
+		if (job.sizes[i] < job.sizes[best])
+			best = i;
+	}
+	
+	if (best != 0)
+	{
+		uint8_t *p_tiles = malloc(tile_count * tile_byte_size);
+		uint32_t *remap = malloc(tile_count * sizeof(uint32_t));
+		uint16_t map_mask = (m_args.map_16bit ? 0x1ff : 0xff);
+		
+		if (p_tiles == NULL || remap == NULL)
+		{
+			exit_with_msg("Can't allocate memory for tile order.\n");
 		}
 		
-		m_block_count++;
+		for (uint32_t i = 0; i < tile_count; i++)
+		{
+			memcpy(&p_tiles[i * tile_byte_size], &m_tiles[job.orders[best][i] * tile_byte_size], tile_byte_size);
+			remap[job.orders[best][i]] = i;
+		}
+		
+		memcpy(m_tiles, p_tiles, tile_count * tile_byte_size);
+		
+		if (use_blocks)
+		{
+			for (uint32_t i = 0; i < cell_count; i++)
+				m_blocks[i] = remap[m_blocks[i]];
+			
+			m_block_hash_init = false;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < cell_count; i++)
+			{
+				m_map_tiles[i] = remap[m_map_tiles[i]];
+				m_map[i] = ((m_args.tile_offset + m_map_tiles[i]) & map_mask) | (m_map[i] & 0xfe00);
+			}
+		}
+		
+		m_tile_hash_init = false;
+		
+		free(p_tiles);
+		free(remap);
 	}
 	
-	return block_index;
+	printf("Tile Order = %s (estimated %d bytes, %d as first seen) in %.1f ms\n", p_order_names[best], (int) job.sizes[best], (int) job.sizes[0], get_time_ms() - start_ms);
+	
+	for (int i = 0; i < order_count; i++)
+		free(job.orders[i]);
+	
+	free(job.counts);
+	free(neighbour_start);
+	free(neighbours);
+	free(keys);
+	free(scores);
+	free(used);
 }
 
 static void process_tiles()
@@ -3573,13 +6972,7 @@ static void process_tiles()
 		
 		if (m_args.tile_y)
 		{
-			for (int x = 0; x < m_tile_width; x++)
-			{
-				for (int y = 0; y < m_tile_height; y++)
-				{
-					m_tiles[x * m_tile_height + y] = m_next_image[y * m_tile_width + x];
-				}
-			}
+			transpose_bitmap(m_tiles, m_tile_height, m_next_image, m_tile_width, m_tile_width, m_tile_height);
 		}
 		else
 		{
@@ -3607,6 +7000,16 @@ static void process_tiles()
 	{
 		uint32_t map_width = m_image_width / (m_tile_width * m_block_width);
 		uint32_t map_height = m_image_height / (m_tile_height * m_block_height);
+		
+		if (m_args.tile_db != NULL && m_tile_count == 0)
+		{
+			load_tile_db();
+		}
+		
+		if (m_args.tile_merge >= 0)
+		{
+			merge_index_init();
+		}
 	
 		if (m_args.tile_y)
 		{
@@ -3617,15 +7020,18 @@ static void process_tiles()
 					if (m_block_width == 1 && m_block_height == 1)
 					{
 						uint8_t attributes = 0;
-						uint32_t ti = m_args.tile_offset + get_tile(x * m_tile_width, y * m_tile_height, &attributes);
+						uint32_t tile_index = get_tile(x * m_tile_width, y * m_tile_height, &attributes);
+						uint32_t ti = m_args.tile_offset + tile_index;
 						uint16_t map_mask = (m_args.map_16bit ? 0x1ff : 0xff);
 						
 						m_map[x * map_height + y] = (ti & map_mask) | (attributes << 8);
+						m_map_tiles[x * map_height + y] = tile_index;
 					}
 					else
 					{
-						uint32_t ti = get_block(x * m_tile_width * m_block_width, y * m_tile_height * m_block_height);
-						m_map[x * map_height + y] = ti;
+						uint8_t mirror = 0;
+						uint32_t ti = get_block(x * m_tile_width * m_block_width, y * m_tile_height * m_block_height, &mirror);
+						m_map[x * map_height + y] = ti | (mirror << 8);
 					}
 				}
 			}
@@ -3639,242 +7045,704 @@ static void process_tiles()
 					if (m_block_width == 1 && m_block_height == 1)
 					{
 						uint8_t attributes = 0;
-						uint32_t ti = m_args.tile_offset + get_tile(x * m_tile_width, y * m_tile_height, &attributes);
+						uint32_t tile_index = get_tile(x * m_tile_width, y * m_tile_height, &attributes);
+						uint32_t ti = m_args.tile_offset + tile_index;
 						uint16_t map_mask = (m_args.map_16bit ? 0x1ff : 0xff);
 						
 						m_map[y * map_width + x] = (ti & map_mask) | (attributes << 8);
+						m_map_tiles[y * map_width + x] = tile_index;
 					}
 					else
 					{
-						uint32_t ti = get_block(x * m_tile_width * m_block_width, y * m_tile_height * m_block_height);
-						m_map[y * map_width + x] = ti;
+						uint8_t mirror = 0;
+						uint32_t ti = get_block(x * m_tile_width * m_block_width, y * m_tile_height * m_block_height, &mirror);
+						m_map[y * map_width + x] = ti | (mirror << 8);
 					}
 				}
 			}
 		}
 	}
 	
-	if (m_args.map_16bit)
-	{
-		if (m_tile_count > 512)
-			printf("Warning tile count > 512!\n");
-	}
-	else
-	{
-		if (m_tile_count > 256)
-			printf("Warning tile count > 256!\n");
-	}
+	if (m_args.tile_reduce >= 0 && (m_args.tile_shared != NULL || m_args.tile_db != NULL))
+	{
+		printf("Warning -tile-reduce is ignored with -tile-shared and -tile-db.\n");
+	}
+	else if (m_args.tile_reduce >= 0 && !m_args.bitmap)
+	{
+		uint32_t map_width = m_image_width / (m_tile_width * m_block_width);
+		uint32_t map_height = m_image_height / (m_tile_height * m_block_height);
+		uint32_t tile_limit = (m_args.map_16bit ? 512 : 256);
+		uint32_t target_count = (m_args.tile_reduce > 0 ? m_args.tile_reduce : (tile_limit > m_args.tile_offset ? tile_limit - m_args.tile_offset : 1));
+		
+		if (m_tile_count > target_count)
+		{
+			reduce_tiles(target_count, map_width * map_height);
+		}
+	}
+	
+	if (m_args.tile_order && (m_args.tile_shared != NULL || m_args.tile_db != NULL))
+	{
+		printf("Warning -tile-order is ignored with -tile-shared and -tile-db.\n");
+	}
+	else if (m_args.tile_order && !m_args.bitmap && !m_args.sprites && !m_args.map_none && m_tile_count > 1)
+	{
+		order_tiles(m_image_width / (m_tile_width * m_block_width), m_image_height / (m_tile_height * m_block_height));
+	}
+	
+	if (m_args.tile_merge >= 0 && !m_args.bitmap)
+	{
+		printf("Tile Merge = %d tiles merged (mean error %.2f, max error %.2f)\n", m_merge_count, m_merge_count ? m_merge_error / m_merge_count : 0.0, m_merge_max_error);
+	}
+	
+	if (m_args.map_16bit)
+	{
+		if (m_tile_count > 512)
+			printf("Warning tile count > 512!\n");
+	}
+	else
+	{
+		if (m_tile_count > 256)
+			printf("Warning tile count > 256!\n");
+	}
+}
+
+static uint8_t attributes_to_tiled_flags(uint8_t attributes)
+{
+	uint8_t tile_flags = attributes;
+	
+	if (attributes & MATCH_ROTATE)
+	{
+		if ((attributes & (MATCH_MIRROR_X | MATCH_MIRROR_Y)) == (MATCH_MIRROR_X | MATCH_MIRROR_Y))
+			tile_flags = TILED_DIAG | TILED_VERT;
+		else if (attributes & MATCH_MIRROR_X)
+			tile_flags = TILED_DIAG;
+		else  if (attributes & MATCH_MIRROR_Y)
+			tile_flags = TILED_DIAG | TILED_HORIZ | TILED_VERT;
+		else
+			tile_flags = TILED_DIAG | TILED_HORIZ;
+	}
+	
+	return tile_flags;
+}
+
+static uint8_t tiled_flags_to_attributes(uint8_t tile_flags)
+{
+	uint8_t attributes = tile_flags;
+		
+	if (tile_flags & TILED_DIAG)
+	{
+		if ((tile_flags & TILED_HORIZ_VERT) == TILED_HORIZ_VERT)
+			attributes = MATCH_ROTATE | MATCH_MIRROR_Y;
+		else if (tile_flags & TILED_HORIZ)
+			attributes = MATCH_ROTATE;
+		else  if (tile_flags & TILED_VERT)
+			attributes = MATCH_ROTATE | MATCH_MIRROR_X | MATCH_MIRROR_Y;
+		else
+			attributes = MATCH_ROTATE | MATCH_MIRROR_X;
+	}
+	
+	return attributes;
+}
+
+typedef enum
+{
+	TMX_ENCODING_XML,
+	TMX_ENCODING_CSV,
+	TMX_ENCODING_BASE64,
+} tmx_encoding_t;
+
+typedef enum
+{
+	TMX_COMPRESSION_NONE,
+	TMX_COMPRESSION_ZLIB,
+	TMX_COMPRESSION_GZIP,
+	TMX_COMPRESSION_ZSTD,
+} tmx_compression_t;
+
+typedef struct
+{
+	int x, y;
+	int width, height;
+	uint32_t tile_offset;
+} tmx_chunk_t;
+
+typedef struct
+{
+	char name[64];
+	int first_chunk;
+	int chunk_count;
+} tmx_layer_t;
+
+typedef struct
+{
+	// Tiles of every layer and chunk in file order. Chunks are only placed
+	// into m_map when their layer is written, so an infinite map needs memory
+	// for the tiles it has, not for the area it spans.
+	int first_gid;
+	uint16_t *p_tiles;
+	int tile_count;
+	int tile_capacity;
+	tmx_chunk_t *p_chunks;
+	int chunk_count;
+	int chunk_capacity;
+	tmx_layer_t *p_layers;
+	int layer_count;
+	int layer_capacity;
+} tmx_map_t;
+
+typedef struct
+{
+	char *p_start;
+	char *p_name;
+	int name_length;
+	char *p_attributes;
+	char *p_end;
+	bool closing;
+	bool self_closing;
+} xml_tag_t;
+
+static char *load_text_file(char *filename, const char *type)
+{
+	uint32_t file_size = get_file_size(filename);
+	char *p_text = malloc(file_size + 1);
+	
+	if (p_text == NULL)
+	{
+		exit_with_msg("Can't allocate memory for %s file %s.\n", type, filename);
+	}
+	
+	read_file(filename, (uint8_t *)p_text, file_size);
+	p_text[file_size] = '\0';
+	
+	m_stats.bytes_in += file_size;
+	
+	return p_text;
+}
+
+static char *next_xml_tag(char *p_text, xml_tag_t *p_tag)
+{
+	// Returns the text following the next element tag, skipping declarations
+	// and comments, or NULL at the end of the document.
+	while ((p_text = strchr(p_text, '<')) != NULL)
+	{
+		if (!strncmp(p_text, "<!--", 4))
+		{
+			char *p_comment_end = strstr(p_text + 4, "-->");
+			
+			if (p_comment_end == NULL)
+				return NULL;
+			
+			p_text = p_comment_end + 3;
+			
+			continue;
+		}
+		
+		char *p_end = strchr(p_text, '>');
+		
+		if (p_end == NULL)
+			return NULL;
+		
+		if (p_text[1] == '?' || p_text[1] == '!')
+		{
+			p_text = p_end + 1;
+			
+			continue;
+		}
+		
+		p_tag->p_start = p_text;
+		p_tag->closing = (p_text[1] == '/');
+		p_tag->p_name = p_text + (p_tag->closing ? 2 : 1);
+		p_tag->name_length = strcspn(p_tag->p_name, " \t\r\n/>");
+		p_tag->p_attributes = p_tag->p_name + p_tag->name_length;
+		p_tag->p_end = p_end;
+		p_tag->self_closing = (p_end[-1] == '/');
+		
+		return p_end + 1;
+	}
+	
+	return NULL;
 }
 
-static uint8_t attributes_to_tiled_flags(uint8_t attributes)
+static bool is_xml_tag(xml_tag_t *p_tag, const char *p_name)
 {
-	uint8_t tile_flags = attributes;
+	return (p_tag->name_length == strlen(p_name) && !strncmp(p_tag->p_name, p_name, p_tag->name_length));
+}
+
+static bool get_xml_str(xml_tag_t *p_tag, const char *p_name, char *p_string, uint32_t string_size)
+{
+	int name_length = strlen(p_name);
+	char *p = p_tag->p_attributes;
 	
-	if (attributes & MATCH_ROTATE)
+	while (p < p_tag->p_end)
 	{
-		if ((attributes & (MATCH_MIRROR_X | MATCH_MIRROR_Y)) == (MATCH_MIRROR_X | MATCH_MIRROR_Y))
-			tile_flags = TILED_DIAG | TILED_VERT;
-		else if (attributes & MATCH_MIRROR_X)
-			tile_flags = TILED_DIAG;
-		else  if (attributes & MATCH_MIRROR_Y)
-			tile_flags = TILED_DIAG | TILED_HORIZ | TILED_VERT;
-		else
-			tile_flags = TILED_DIAG | TILED_HORIZ;
+		while (p < p_tag->p_end && isspace((unsigned char)*p))
+			p++;
+		
+		char *p_attribute = p;
+		
+		while (p < p_tag->p_end && *p != '=' && !isspace((unsigned char)*p))
+			p++;
+		
+		int attribute_length = p - p_attribute;
+		
+		if (p >= p_tag->p_end || *p != '=' || (p[1] != '"' && p[1] != '\''))
+			return false;
+		
+		char quote = p[1];
+		char *p_value = p + 2;
+		char *p_value_end = memchr(p_value, quote, p_tag->p_end - p_value);
+		
+		if (p_value_end == NULL)
+			return false;
+		
+		if (attribute_length == name_length && !strncmp(p_attribute, p_name, name_length))
+		{
+			uint32_t length = MIN(p_value_end - p_value, string_size - 1);
+			
+			memcpy(p_string, p_value, length);
+			p_string[length] = '\0';
+			
+			return true;
+		}
+		
+		p = p_value_end + 1;
 	}
 	
-	return tile_flags;
+	return false;
 }
 
-static uint8_t tiled_flags_to_attributes(uint8_t tile_flags)
+static bool get_xml_int(xml_tag_t *p_tag, const char *p_name, int *p_value)
 {
-	uint8_t attributes = tile_flags;
-		
-	if (tile_flags & TILED_DIAG)
+	char string[32];
+	
+	if (!get_xml_str(p_tag, p_name, string, sizeof(string)))
+		return false;
+	
+	*p_value = atoi(string);
+	
+	return true;
+}
+
+static void *grow_array(void *p_array, int *p_capacity, int count, size_t item_size)
+{
+	if (count < *p_capacity)
+		return p_array;
+	
+	*p_capacity = (*p_capacity == 0 ? 64 : *p_capacity * 2);
+	p_array = realloc(p_array, *p_capacity * item_size);
+	
+	if (p_array == NULL)
 	{
-		if ((tile_flags & TILED_HORIZ_VERT) == TILED_HORIZ_VERT)
-			attributes = MATCH_ROTATE | MATCH_MIRROR_Y;
-		else if (tile_flags & TILED_HORIZ)
-			attributes = MATCH_ROTATE;
-		else  if (tile_flags & TILED_VERT)
-			attributes = MATCH_ROTATE | MATCH_MIRROR_X | MATCH_MIRROR_Y;
-		else
-			attributes = MATCH_ROTATE | MATCH_MIRROR_X;
+		exit_with_msg("Can't allocate memory for Tiled map.\n");
 	}
 	
-	return attributes;
+	return p_array;
+}
+
+static void add_tiled_tile(tmx_map_t *p_map, uint32_t tile_id)
+{
+	// Check for erased tile and replace it with the blank tile ID
+	if (tile_id == 0)
+		tile_id = m_args.tiled_blank;
+	else
+		tile_id -= p_map->first_gid;
+	
+	uint8_t attributes = tiled_flags_to_attributes(tile_id >> 28);
+	
+	// Tiles outside a layer have nowhere to go.
+	if (p_map->chunk_count == 0)
+		return;
+	
+	p_map->p_tiles = grow_array(p_map->p_tiles, &p_map->tile_capacity, p_map->tile_count, sizeof(uint16_t));
+	p_map->p_tiles[p_map->tile_count++] = (tile_id & TILED_TILEID_MASK) | (attributes << 8);
 }
 
-static void parse_tile(char *line, int first_gid, int *tile_count)
+static void add_tiled_chunk(tmx_map_t *p_map, int x, int y, int width, int height)
 {
-	char *pch = strtok(line, ",\r\n");
+	tmx_layer_t *p_layer = &p_map->p_layers[p_map->layer_count - 1];
+	tmx_chunk_t *p_chunk = (p_map->chunk_count > 0 ? &p_map->p_chunks[p_map->chunk_count - 1] : NULL);
 	
-	while (pch != NULL)
+	// A chunked layer replaces the empty chunk made for its <data> tag.
+	if (p_layer->chunk_count == 0 || p_chunk->tile_offset != p_map->tile_count)
 	{
-        uint32_t tile_id = atoi(pch);
+		p_map->p_chunks = grow_array(p_map->p_chunks, &p_map->chunk_capacity, p_map->chunk_count, sizeof(tmx_chunk_t));
+		p_chunk = &p_map->p_chunks[p_map->chunk_count++];
+		p_layer->chunk_count++;
+	}
+	
+	p_chunk->x = x;
+	p_chunk->y = y;
+	p_chunk->width = width;
+	p_chunk->height = height;
+	p_chunk->tile_offset = p_map->tile_count;
+}
 
-        // Check for erased tile and replace it with the blank tile ID
-        if (tile_id == 0)
-            tile_id = m_args.tiled_blank;
-        else
-            tile_id -= first_gid;
+static void parse_tiled_csv(tmx_map_t *p_map, char *p_text, char *p_text_end)
+{
+	while (p_text < p_text_end)
+	{
+		if (*p_text < '0' || *p_text > '9')
+		{
+			p_text++;
+			
+			continue;
+		}
 		
-		uint8_t attributes = tiled_flags_to_attributes(tile_id >> 28);
-
-		m_map[(*tile_count)++] = (tile_id & TILED_TILEID_MASK) | (attributes << 8);
+		uint32_t tile_id = 0;
 		
-		pch = strtok(NULL, ",\r\n");
+		while (p_text < p_text_end && *p_text >= '0' && *p_text <= '9')
+			tile_id = tile_id * 10 + (*p_text++ - '0');
+		
+		add_tiled_tile(p_map, tile_id);
 	}
 }
 
-/* static void parse_csv(char *filename, int *tile_count)
+static uint32_t decode_base64(char *p_text, char *p_text_end)
 {
-	char line[512];
-	FILE *csv_file = fopen(filename, "r");
+	// Decodes in place, the output is always shorter than the text.
+	uint8_t *p_out = (uint8_t *)p_text;
+	uint32_t bits = 0, bit_count = 0, out_size = 0;
 	
-	while (fgets(line, 512, csv_file))
+	for (; p_text < p_text_end && *p_text != '='; p_text++)
 	{
-		parse_tile(line, 0, tile_count);
+		char c = *p_text;
+		uint32_t value;
+		
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '+')
+			value = 62;
+		else if (c == '/')
+			value = 63;
+		else
+			continue;
+		
+		bits = (bits << 6) | value;
+		bit_count += 6;
+		
+		if (bit_count >= 8)
+		{
+			bit_count -= 8;
+			p_out[out_size++] = (bits >> bit_count) & 0xff;
+		}
 	}
-} */
+	
+	return out_size;
+}
+
+static uint32_t get_gzip_header_size(uint8_t *p_data, uint32_t data_size)
+{
+	uint32_t offset = 10;
+	
+	if (data_size < 18 || p_data[0] != 0x1f || p_data[1] != 0x8b || p_data[2] != 8)
+		return 0;
+	
+	uint8_t flags = p_data[3];
+	
+	if (flags & 0x04)
+		offset += 2 + (p_data[10] | (p_data[11] << 8));
+	if (flags & 0x08)
+		offset += strnlen((char *)&p_data[offset], data_size - offset) + 1;
+	if (flags & 0x10)
+		offset += strnlen((char *)&p_data[offset], data_size - offset) + 1;
+	if (flags & 0x02)
+		offset += 2;
+	
+	return (offset < data_size ? offset : 0);
+}
 
-static bool get_str(char *line, char *name, char *string)
+static void parse_tiled_data(tmx_map_t *p_map, char *filename, char *p_text, char *p_text_end, tmx_encoding_t encoding, tmx_compression_t compression)
 {
-	char *pch = NULL, *pch_s = NULL, *pch_e = NULL;
+	if (encoding == TMX_ENCODING_CSV)
+	{
+		parse_tiled_csv(p_map, p_text, p_text_end);
+		
+		return;
+	}
+	
+	if (encoding != TMX_ENCODING_BASE64)
+		return;
+	
+	uint8_t *p_data = (uint8_t *)p_text;
+	uint32_t data_size = decode_base64(p_text, p_text_end);
+	uint8_t *p_inflated = NULL;
+	size_t inflated_size = 0;
+	
+	if (data_size == 0)
+		return;
 	
-	if ((pch = strstr(line, name)))
+	if (compression == TMX_COMPRESSION_ZLIB || compression == TMX_COMPRESSION_GZIP)
 	{
-		pch_s = pch + strlen(name) + 1;
-		if ((pch_e = strstr(pch_s, "\"")))
+		unsigned error;
+		
+		if (compression == TMX_COMPRESSION_ZLIB)
+		{
+			error = lodepng_zlib_decompress(&p_inflated, &inflated_size, p_data, data_size, &lodepng_default_decompress_settings);
+		}
+		else
 		{
-			uint32_t len = pch_e - pch_s;
-			strncpy(string, pch_s, len);
-			string[len] = '\0';
+			uint32_t header_size = get_gzip_header_size(p_data, data_size);
 			
-			return true;
+			if (header_size == 0)
+			{
+				exit_with_msg("Invalid gzip layer data in %s.\n", filename);
+			}
+			
+			error = lodepng_inflate(&p_inflated, &inflated_size, &p_data[header_size], data_size - header_size - 8, &lodepng_default_decompress_settings);
+		}
+		
+		if (error)
+		{
+			exit_with_msg("Can't decompress layer data in %s (%s).\n", filename, lodepng_error_text(error));
 		}
+		
+		p_data = p_inflated;
+		data_size = inflated_size;
 	}
 	
-	return false;
+	for (uint32_t i = 0; i + 3 < data_size; i += 4)
+	{
+		add_tiled_tile(p_map, p_data[i] | (p_data[i + 1] << 8) | (p_data[i + 2] << 16) | ((uint32_t)p_data[i + 3] << 24));
+	}
+	
+	free(p_inflated);
 }
 
-static bool get_int(char *line, char *name, int *value)
+static void parse_tsx(char *filename, char *bitmap_filename)
 {
-	char string[32];
+	char *p_tsx = load_text_file(filename, "tsx");
+	char *p_text = p_tsx;
+	xml_tag_t tag;
 	
-	memset(string, 0, 32);
-	
-	if (!get_str(line, name, string))
-		return false;
+	while ((p_text = next_xml_tag(p_text, &tag)) != NULL)
+	{
+		if (!tag.closing && is_xml_tag(&tag, "image"))
+		{
+			get_xml_str(&tag, "source", bitmap_filename, 256);
+		}
+	}
 	
-	*value = atoi(string);
-		
-	return true;
+	free(p_tsx);
 }
 
-static void parse_tsx(char *filename, char *bitmap_filename)
+static void write_tiled_layer(tmx_map_t *p_map, tmx_layer_t *p_layer, int layer_index, int tile_width, int tile_height)
 {
-	char line[512];
-	FILE *tsx_file = fopen(filename, "r");
+	tmx_chunk_t *p_chunks = &p_map->p_chunks[p_layer->first_chunk];
+	int min_x = INT32_MAX, min_y = INT32_MAX, max_x = INT32_MIN, max_y = INT32_MIN;
+	
+	if (p_layer->chunk_count == 0)
+		return;
+	
+	for (int i = 0; i < p_layer->chunk_count; i++)
+	{
+		min_x = MIN(min_x, p_chunks[i].x);
+		min_y = MIN(min_y, p_chunks[i].y);
+		max_x = MAX(max_x, p_chunks[i].x + p_chunks[i].width);
+		max_y = MAX(max_y, p_chunks[i].y + p_chunks[i].height);
+	}
 	
-	if (tsx_file == NULL)
+	int map_width = max_x - min_x;
+	int map_height = max_y - min_y;
+	
+	if ((int64_t)map_width * map_height > MAP_SIZE)
 	{
-		exit_with_msg("Can't open tsx file %s.\n", filename);
+		exit_with_msg("Tiled layer %s is %d x %d tiles, the maximum is %d tiles.\n", p_layer->name, map_width, map_height, MAP_SIZE);
 	}
 	
-	while (fgets(line, 512, tsx_file))
+	// Cells not covered by any chunk are blank.
+	for (int i = 0; i < map_width * map_height; i++)
+		m_map[i] = m_args.tiled_blank & TILED_TILEID_MASK;
+	
+	for (int i = 0; i < p_layer->chunk_count; i++)
 	{
-		if (strstr(line, "<image"))
+		tmx_chunk_t *p_chunk = &p_chunks[i];
+		int chunk_index = p_layer->first_chunk + i;
+		uint32_t chunk_end = (chunk_index + 1 < p_map->chunk_count ? p_map->p_chunks[chunk_index + 1].tile_offset : p_map->tile_count);
+		uint32_t tile_count = MIN(chunk_end - p_chunk->tile_offset, (uint32_t)(p_chunk->width * p_chunk->height));
+		
+		for (uint32_t t = 0; t < tile_count; t++)
 		{
-			get_str(line, "source=", bitmap_filename);
+			int x = p_chunk->x - min_x + t % p_chunk->width;
+			int y = p_chunk->y - min_y + t / p_chunk->width;
+			
+			m_map[y * map_width + x] = p_map->p_tiles[p_chunk->tile_offset + t];
 		}
 	}
 	
-	fclose(tsx_file);
+	if (p_map->layer_count > 1)
+	{
+		char layer_filename[256] = { 0 };
+		char *out_filename = m_args.out_filename;
+		
+		printf("Tiled Layer %d = %s\n", layer_index, p_layer->name);
+		
+		// Each layer gets its own numbered map file.
+		create_series_filename(layer_filename, m_args.out_filename, EXT_TMX, false, layer_index);
+		
+		m_args.out_filename = layer_filename;
+		
+		write_map(map_width * tile_width, map_height * tile_height, tile_width, tile_height, 1, 1);
+		
+		m_args.out_filename = out_filename;
+	}
+	else
+	{
+		write_map(map_width * tile_width, map_height * tile_height, tile_width, tile_height, 1, 1);
+	}
 }
 
 static void parse_tmx(char *filename, char *bitmap_filename)
 {
-	char *line = NULL, string[32];
+	// Single pass over the document. Layer data is decoded straight from the
+	// text between tags into the layer's chunks, base64 is decoded in place.
+	char *p_tmx = load_text_file(filename, "tmx");
+	char *p_text = p_tmx;
+	char string[32];
 	char tileset_filename[256] = { 0 };
-	size_t	cnt = 0;
-	FILE *tmx_file = fopen(filename, "r");
-	
-	if (tmx_file == NULL)
-	{
-		exit_with_msg("Can't open tmx file %s.\n", filename);
-	}
+	xml_tag_t tag;
+	tmx_map_t map = { 0 };
 	
 	int map_width = 0, map_height = 0;
 	int tile_width = 0, tile_height = 0;
-	int tile_count = 0;
-	int first_gid = 0;
+	int layer_width = 0, layer_height = 0;
 	bool is_data = false;
+	tmx_encoding_t encoding = TMX_ENCODING_XML;
+	tmx_compression_t compression = TMX_COMPRESSION_NONE;
 	
-	while (getline(&line, &cnt, tmx_file) != -1)
+	while (true)
 	{
-		if (strstr(line, "<map"))
+		char *p_text_start = p_text;
+		
+		if ((p_text = next_xml_tag(p_text, &tag)) == NULL)
+			break;
+		
+		if (is_data && tag.p_start > p_text_start)
+		{
+			parse_tiled_data(&map, filename, p_text_start, tag.p_start, encoding, compression);
+		}
+		
+		if (tag.closing)
 		{
-			get_int(line, "width=", &map_width);
-			get_int(line, "height=", &map_height);
-			get_int(line, "tilewidth=", (int *)&tile_width);
-			get_int(line, "tileheight=", (int *)&tile_height);
+			if (is_xml_tag(&tag, "data"))
+				is_data = false;
 			
 			continue;
 		}
 		
-		if (strstr(line, "<tileset"))
+		if (is_xml_tag(&tag, "map"))
+		{
+			get_xml_int(&tag, "width", &map_width);
+			get_xml_int(&tag, "height", &map_height);
+			get_xml_int(&tag, "tilewidth", &tile_width);
+			get_xml_int(&tag, "tileheight", &tile_height);
+		}
+		else if (is_xml_tag(&tag, "tileset"))
 		{
-			get_int(line, "firstgid=", &first_gid);
-			get_str(line, "source=", tileset_filename);
+			get_xml_int(&tag, "firstgid", &map.first_gid);
 			
-			if (!m_args.tile_none && strlen(tileset_filename) != 0)
+			if (get_xml_str(&tag, "source", tileset_filename, sizeof(tileset_filename)) && !m_args.tile_none)
 			{
 				parse_tsx(tileset_filename, bitmap_filename);
 			}
-			
-			continue;
 		}
-		
-		if (strstr(line, "<image"))
+		else if (is_xml_tag(&tag, "image"))
 		{
-			get_str(line, "source=", bitmap_filename);
+			get_xml_str(&tag, "source", bitmap_filename, 256);
 		}
-		
-		if (strstr(line, "<data"))
+		else if (is_xml_tag(&tag, "layer"))
 		{
-			if (get_str(line, "encoding=", string))
+			map.p_layers = grow_array(map.p_layers, &map.layer_capacity, map.layer_count, sizeof(tmx_layer_t));
+			
+			tmx_layer_t *p_layer = &map.p_layers[map.layer_count++];
+			
+			memset(p_layer, 0, sizeof(tmx_layer_t));
+			p_layer->first_chunk = map.chunk_count;
+			
+			if (!get_xml_str(&tag, "name", p_layer->name, sizeof(p_layer->name)))
+				snprintf(p_layer->name, sizeof(p_layer->name), "%d", map.layer_count);
+			
+			layer_width = map_width;
+			layer_height = map_height;
+			
+			get_xml_int(&tag, "width", &layer_width);
+			get_xml_int(&tag, "height", &layer_height);
+		}
+		else if (is_xml_tag(&tag, "data"))
+		{
+			encoding = TMX_ENCODING_XML;
+			compression = TMX_COMPRESSION_NONE;
+			
+			if (get_xml_str(&tag, "encoding", string, sizeof(string)))
 			{
-				if (strstr(line, "csv"))
-				{
-					is_data = true;
-				}
+				if (!strcmp(string, "csv"))
+					encoding = TMX_ENCODING_CSV;
+				else if (!strcmp(string, "base64"))
+					encoding = TMX_ENCODING_BASE64;
+				else
+					exit_with_msg("Unsupported layer encoding %s in %s.\n", string, filename);
 			}
 			
-			continue;
+			if (get_xml_str(&tag, "compression", string, sizeof(string)))
+			{
+				if (!strcmp(string, "zlib"))
+					compression = TMX_COMPRESSION_ZLIB;
+				else if (!strcmp(string, "gzip"))
+					compression = TMX_COMPRESSION_GZIP;
+				else if (!strcmp(string, "zstd"))
+					exit_with_msg("Layer compression zstd in %s is not supported, save the map with zlib, gzip or csv.\n", filename);
+				else
+					exit_with_msg("Unsupported layer compression %s in %s.\n", string, filename);
+			}
+			
+			if (map.layer_count > 0)
+			{
+				add_tiled_chunk(&map, 0, 0, layer_width, layer_height);
+			}
+			
+			is_data = !tag.self_closing;
 		}
-		
-		if (strstr(line, "</data>"))
+		else if (is_data && is_xml_tag(&tag, "chunk"))
 		{
-			is_data = false;
-			continue;
+			int x = 0, y = 0, width = 0, height = 0;
+			
+			get_xml_int(&tag, "x", &x);
+			get_xml_int(&tag, "y", &y);
+			get_xml_int(&tag, "width", &width);
+			get_xml_int(&tag, "height", &height);
+			
+			if (width > 0 && height > 0)
+			{
+				add_tiled_chunk(&map, x, y, width, height);
+			}
+		}
+		else if (is_data && encoding == TMX_ENCODING_XML && is_xml_tag(&tag, "tile"))
+		{
+			uint32_t tile_id = 0;
+			
+			if (get_xml_str(&tag, "gid", string, sizeof(string)))
+				tile_id = strtoul(string, NULL, 10);
+			
+			add_tiled_tile(&map, tile_id);
 		}
-		
-		if (!is_data)
-			continue;
-		
-		parse_tile(line, first_gid, &tile_count);
 	}
 	
-	free(line);
-	fclose(tmx_file);
+	free(p_tmx);
 	
-	int image_width = map_width * tile_width;
-	int image_height = map_height * tile_height;
-
 	if (!m_args.map_none)
 	{
-		write_map(image_width, image_height, tile_width, tile_height, 1, 1);
+		for (int i = 0; i < map.layer_count; i++)
+		{
+			write_tiled_layer(&map, &map.p_layers[i], i, tile_width, tile_height);
+		}
 	}
+	
+	free(map.p_tiles);
+	free(map.p_chunks);
+	free(map.p_layers);
 }
 
 int process_file()
@@ -3914,6 +7782,8 @@ int process_file()
 			p_ext = strrchr(m_args.in_filename,'.');
 		}
 		
+		double start_ms = get_time_ms();
+		
 		if (strcasecmp(p_ext, ".png") == 0)
 		{
 			read_png();
@@ -3926,22 +7796,21 @@ int process_file()
 		{
 			read_aseprite();
 		}
+		
+		stats_end(STAGE_DECODE, start_ms);
+		
+		m_stats.bytes_in += get_file_size(m_args.in_filename);
 	}
 	
 	if (m_args.asm_mode > ASMMODE_NONE)
 	{
 		char asm_filename[256] = { 0 };
-		char *open_args = (m_args.asm_file != NULL && !m_args.asm_start ? "a" : "w");
+		bool append = (m_args.asm_file != NULL && !m_args.asm_start);
 		char *asm_file = (m_args.asm_file != NULL ? m_args.asm_file : m_args.out_filename);
 		
 		create_filename(asm_filename,asm_file , ".asm", false);
 		
-		m_asm_file = fopen(asm_filename, open_args);
-		
-		if (m_asm_file == NULL)
-		{
-			exit_with_msg("Can't create asm file %s.\n", asm_filename);
-		}
+		m_asm_file = open_output(asm_filename, append);
 		
 		if (m_args.asm_file == NULL || m_args.asm_start)
 		{
@@ -3954,12 +7823,7 @@ int process_file()
 			
 			create_filename(header_filename, asm_file, ".h", false);
 			
-			m_header_file = fopen(header_filename, open_args);
-			
-			if (m_header_file == NULL)
-			{
-				exit_with_msg("Can't create header file '%s' (%s).\n", header_filename, open_args);
-			}
+			m_header_file = open_output(header_filename, append);
 
 			if (m_args.asm_file == NULL || m_args.asm_start)
 			{
@@ -3976,17 +7840,16 @@ int process_file()
 	else if (m_args.bitmap)
 	{
 		// Open the raw image output file.
-		m_bitmap_file = fopen(m_bitmap_filename, "wb");
-		
-		if (m_bitmap_file == NULL)
-		{
-			exit_with_msg("Can't create raw image file %s.\n", m_bitmap_filename);
-		}
+		m_bitmap_file = open_output(m_bitmap_filename, false);
 	}
 	
 	if ((!m_args.screen) && (!m_args.pal_zx))
 	{
+		double start_ms = get_time_ms();
+		
 		process_palette();
+		
+		stats_end(STAGE_PALETTE, start_ms);
 	}
 	
 	if (m_args.pal_file != NULL)
@@ -4029,7 +7892,10 @@ int process_file()
 	
 	if (m_args.screen)
 	{
-		write_screen();
+		if (m_args.screen_hires)
+			write_screen_hires();
+		else
+			write_screen();
 		
 		if (m_args.asm_mode == ASMMODE_Z80ASM)
 		{
@@ -4044,7 +7910,16 @@ int process_file()
 	
 	if (!m_args.tile_none)
 	{
+		double start_ms = get_time_ms();
+		
 		process_tiles();
+		
+		if (m_args.tile_db != NULL && !m_args.bitmap)
+		{
+			save_tile_db();
+		}
+		
+		stats_end(STAGE_TILES, start_ms);
 	}
 	
 	if (m_args.pal_zx)
@@ -4092,7 +7967,21 @@ int process_file()
 			printf("Tile Palette = %d\n", m_args.tile_pal);
 			printf("Tile Count = %d\n", m_tile_count);
 			
-			write_tiles_sprites();
+			if (m_args.tile_shared == NULL)
+			{
+				write_tiles_sprites();
+			}
+			else if (m_tile_shared_write)
+			{
+				// The shared tileset is written once, with the last file.
+				char *out_filename = m_args.out_filename;
+				
+				m_args.out_filename = m_args.tile_shared;
+				
+				write_tiles_sprites();
+				
+				m_args.out_filename = out_filename;
+			}
 		}
 	}
 	
@@ -4109,6 +7998,8 @@ int process_file()
 
 int main(int argc, char *argv[])
 {
+	double start_ms = get_time_ms();
+	
 	atexit(exit_handler);
 
 	// Parse program arguments.
@@ -4151,15 +8042,20 @@ int main(int argc, char *argv[])
 			m_args.in_filename = *filename;
 			m_args.out_filename = *filename;
 			
-			m_tile_count = 0;
+			if (m_args.tile_shared == NULL)
+			{
+				m_tile_count = 0;
+			}
+			
 			m_bank_section_index = 0;
+			m_tile_shared_write = (filename[1] == NULL);
 			
 			process_file();
 			close_all();
 			
 			filename++;
 			
-			if (m_args.tile_offset_auto)
+			if (m_args.tile_offset_auto && m_args.tile_shared == NULL)
 			{
 				m_args.tile_offset += m_tile_count;
 			}
@@ -4187,6 +8083,10 @@ int main(int argc, char *argv[])
 	{
 		process_file();
 	}
+	
+	close_all();
+	flush_outputs();
+	check_outputs();
 
 	for (int i = 0; i < NUM_BANKS; i++)
 	{
@@ -4196,5 +8096,10 @@ int main(int argc, char *argv[])
 		printf("BANK_%d = %d bytes used\n", i,  m_bank_used[i]);
 	}
 	
+	if (m_args.stats != STATS_NONE)
+	{
+		print_stats(get_time_ms() - start_ms);
+	}
+	
 	return 0;
 }
@@ -25,27 +25,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "zx0.h"
 
-unsigned char *input_data;
-unsigned char *output_data;
-size_t input_index;
-size_t output_index;
-size_t input_size;
-size_t output_size;
-int bit_mask;
-int bit_value;
-int backtrack;
-int last_byte;
-int last_offset;
-
-BLOCK *ghost_root = NULL;
-BLOCK *dead_array = NULL;
-int dead_array_size = 0;
-
-int bit_index;
-int diff;
+/* all state is per thread so buffers can be compressed concurrently */
+static _Thread_local unsigned char *input_data;
+static _Thread_local unsigned char *output_data;
+static _Thread_local size_t input_index;
+static _Thread_local size_t output_index;
+static _Thread_local size_t input_size;
+static _Thread_local size_t output_size;
+static _Thread_local int bit_mask;
+static _Thread_local int bit_value;
+static _Thread_local int backtrack;
+static _Thread_local int last_byte;
+static _Thread_local int last_offset;
+static _Thread_local size_t output_capacity;
+static _Thread_local int data_error;
+
+static _Thread_local BLOCK *ghost_root = NULL;
+static _Thread_local BLOCK *dead_array = NULL;
+static _Thread_local int dead_array_size = 0;
+static _Thread_local BLOCK **block_arrays = NULL;
+static _Thread_local int block_array_count = 0;
+
+static _Thread_local int bit_index;
+static _Thread_local int diff;
+
+static _Thread_local bool show_progress = TRUE;
+
+void zx0_set_progress(bool progress) {
+    show_progress = progress;
+}
+
+void zx0_free_blocks(void) {
+    int i;
+
+    for (i = 0; i < block_array_count; i++)
+        free(block_arrays[i]);
+    free(block_arrays);
+    block_arrays = NULL;
+    block_array_count = 0;
+    ghost_root = NULL;
+    dead_array = NULL;
+    dead_array_size = 0;
+}
 
 BLOCK *allocate(int bits, int index, int offset, int length, BLOCK *chain) {
     BLOCK *ptr;
@@ -62,10 +87,12 @@ BLOCK *allocate(int bits, int index, int offset, int length, BLOCK *chain) {
     } else {
         if (!dead_array_size) {
             dead_array = (BLOCK *)malloc(QTY_BLOCKS*sizeof(BLOCK));
-            if (!dead_array) {
+            block_arrays = (BLOCK **)realloc(block_arrays, (block_array_count+1)*sizeof(BLOCK *));
+            if (!dead_array || !block_arrays) {
                 fprintf(stderr, "Error: Insufficient memory\n");
                 exit(1);
             }
+            block_arrays[block_array_count++] = dead_array;
             dead_array_size = QTY_BLOCKS;
         }
         ptr = &dead_array[--dead_array_size];
@@ -135,7 +162,8 @@ BLOCK* optimize(unsigned char *input_data, size_t input_size, int skip, int offs
     /* start with fake block */
     assign(&(last_match[INITIAL_OFFSET]), allocate(-1, skip-1, INITIAL_OFFSET, 0, NULL));
 
-    printf("[");
+    if (show_progress)
+        printf("[");
 
     /* process remaining bytes */
     for (index = skip; index < input_size; index++) {
@@ -187,16 +215,25 @@ BLOCK* optimize(unsigned char *input_data, size_t input_size, int skip, int offs
             }
         }
 
-        if (index*MAX_SCALE/input_size > dots) {
+        if (show_progress && index*MAX_SCALE/input_size > dots) {
             printf(".");
             fflush(stdout);
             dots++;
         }
     }
 
-    printf("]\n");
+    if (show_progress)
+        printf("]\n");
+
+    BLOCK *result = optimal[input_size-1];
 
-    return optimal[input_size-1];
+    free(last_literal);
+    free(last_match);
+    free(optimal);
+    free(match_length);
+    free(best_length);
+
+    return result;
 }
 
 void reverse(unsigned char *first, unsigned char *last) {
@@ -224,9 +261,9 @@ void write_byte(int value) {
 void write_bytes(int offset, int length) {
     int i;
 
-    if (offset > output_size+output_index) {
-        fprintf(stderr, "Error: Invalid data\n");
-        exit(1);
+    if (offset <= 0 || offset > output_size+output_index || length < 0 || length > output_capacity-output_index) {
+        data_error = TRUE;
+        return;
     }
     while (length-- > 0) {
         i = output_index-offset;
@@ -265,6 +302,10 @@ void write_interlaced_elias_gamma(int value, int backwards_mode) {
 }
 
 int read_byte() {
+    if (input_index >= input_size) {
+        data_error = TRUE;
+        return 0;
+    }
     last_byte = input_data[input_index++];
     return last_byte;
 }
@@ -282,9 +323,13 @@ int read_bit() {
     return bit_value & bit_mask ? 1 : 0;
 }
 
-int read_interlaced_elias_gamma() {
+int read_interlaced_elias_gamma(int backwards_mode) {
     int value = 1;
-    while (!read_bit()) {
+    while (!data_error && read_bit() == backwards_mode) {
+        if (value > 0xffffff) {
+            data_error = TRUE;
+            break;
+        }
         value = value << 1 | read_bit();
     }
     return value;
@@ -292,9 +337,19 @@ int read_interlaced_elias_gamma() {
 
 unsigned char *zx0_compress(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode, size_t *out_size) {
     int skip = 0;
-    
-    if (backwards_mode)
-        reverse(input_data, input_data+input_size-1);
+    unsigned char *reversed_data = NULL;
+
+    /* compress a reversed copy so the caller's buffer is left untouched */
+    if (backwards_mode) {
+        reversed_data = (unsigned char *)malloc(input_size);
+        if (!reversed_data) {
+             fprintf(stderr, "Error: Insufficient memory\n");
+             exit(1);
+        }
+        memcpy(reversed_data, input_data, input_size);
+        reverse(reversed_data, reversed_data+input_size-1);
+        input_data = reversed_data;
+    }
 
     /* generate output file */
     BLOCK *optimal = optimize(input_data, input_size, 0, quick_mode ? MAX_OFFSET_ZX7 : MAX_OFFSET_ZX0);
@@ -328,6 +383,7 @@ unsigned char *zx0_compress(unsigned char *input_data, size_t input_size, bool q
     input_index = skip;
     output_index = 0;
     bit_mask = 0;
+    backtrack = FALSE;
 
     for (optimal = next->chain; optimal; optimal = optimal->chain) {
         if (!optimal->offset) {
@@ -379,55 +435,256 @@ unsigned char *zx0_compress(unsigned char *input_data, size_t input_size, bool q
     write_interlaced_elias_gamma(256, backwards_mode);
 
     /* conditionally reverse output file */
-    if (backwards_mode)
+    if (backwards_mode) {
         reverse(output_data, output_data+*out_size-1);
+        free(reversed_data);
+    }
+
+    zx0_free_blocks();
 
     return output_data;
 }
 
-void zx0_decompress(unsigned char *in_data, unsigned char *out_data) {
+size_t zx0_estimate(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode) {
+    unsigned char *reversed_data = NULL;
+    bool progress = show_progress;
+    size_t size;
+
+    /* same optimal parse as zx0_compress, but only its cost is kept */
+    if (backwards_mode) {
+        reversed_data = (unsigned char *)malloc(input_size);
+        if (!reversed_data) {
+             fprintf(stderr, "Error: Insufficient memory\n");
+             exit(1);
+        }
+        memcpy(reversed_data, input_data, input_size);
+        reverse(reversed_data, reversed_data+input_size-1);
+        input_data = reversed_data;
+    }
+
+    show_progress = FALSE;
+    size = (optimize(input_data, input_size, 0, quick_mode ? MAX_OFFSET_ZX7 : MAX_OFFSET_ZX0)->bits+18+7)/8;
+    show_progress = progress;
+
+    zx0_free_blocks();
+    free(reversed_data);
+
+    return size;
+}
+
+static void greedy_insert(unsigned char *input_data, size_t input_size, int index, int *head, int *prev) {
+    int hash;
+
+    if (index+1 < input_size) {
+        hash = GREEDY_HASH(input_data, index);
+        prev[index] = head[hash];
+        head[hash] = index;
+    }
+}
+
+static int greedy_match(unsigned char *input_data, size_t input_size, int index, int offset_limit, int *head, int *prev, int *best_offset) {
+    int best_length = 0;
+    int length;
+    int depth;
+    int next;
+
+    if (index+1 >= input_size)
+        return 0;
+
+    /* longest match along the hash chain, nearest first */
+    next = head[GREEDY_HASH(input_data, index)];
+    for (depth = 0; next >= 0 && next < index && index-next <= offset_limit && depth < GREEDY_CHAIN_DEPTH; depth++, next = prev[next]) {
+        for (length = 0; index+length < input_size && input_data[next+length] == input_data[index+length]; length++)
+            ;
+        if (length > best_length) {
+            best_length = length;
+            *best_offset = index-next;
+        }
+    }
+    return best_length;
+}
+
+size_t zx0_estimate_greedy(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode) {
+    unsigned char *reversed_data = NULL;
+    int offset_limit = quick_mode ? MAX_OFFSET_ZX7 : MAX_OFFSET_ZX0;
+    int *head;
+    int *prev;
+    long bits = -1;
+    long literal_bits;
+    int literals = 0;
+    int last_offset = INITIAL_OFFSET;
+    int index = 0;
+    int i;
+
+    /*
+     * Greedy parse that obeys the zx0 block rules (a repeat offset only after
+     * literals, no two literal runs in a row), so it is the cost of a real
+     * stream and never below the optimal size. It is also capped by the cost
+     * of storing everything as one literal run, so it is at most a few bytes
+     * over the input size. Typically 0-20% above zx0_estimate for a fraction
+     * of its time.
+     */
+    if (backwards_mode) {
+        reversed_data = (unsigned char *)malloc(input_size);
+        if (!reversed_data) {
+             fprintf(stderr, "Error: Insufficient memory\n");
+             exit(1);
+        }
+        memcpy(reversed_data, input_data, input_size);
+        reverse(reversed_data, reversed_data+input_size-1);
+        input_data = reversed_data;
+    }
+
+    head = (int *)malloc(GREEDY_HASH_SIZE*sizeof(int));
+    prev = (int *)malloc((input_size+1)*sizeof(int));
+    if (!head || !prev) {
+         fprintf(stderr, "Error: Insufficient memory\n");
+         exit(1);
+    }
+    for (i = 0; i < GREEDY_HASH_SIZE; i++)
+        head[i] = -1;
+
+    while (index < input_size) {
+        int best_offset;
+        int best_length = greedy_match(input_data, input_size, index, offset_limit, head, prev, &best_offset);
+        int match_bits = best_length >= 2 ? 8 + elias_gamma_bits((best_offset-1)/128+1) + elias_gamma_bits(best_length-1) : 0;
+        int match_gain = best_length >= 2 ? best_length*8 - match_bits : 0;
+        int last_length = 0;
+        int last_gain = 0;
+        int length;
+
+        /* repeat of the last offset, only allowed straight after literals */
+        if (literals && index >= last_offset) {
+            for (length = 0; index+length < input_size && input_data[index+length-last_offset] == input_data[index+length]; length++)
+                ;
+            last_length = length;
+            if (last_length)
+                last_gain = last_length*8 - (1 + elias_gamma_bits(last_length));
+        }
+
+        /* lazy step: a literal now may allow a better match next byte */
+        if (match_gain > 0 && last_gain < match_gain && index+1 < input_size) {
+            int next_offset;
+            int next_length = greedy_match(input_data, input_size, index+1, offset_limit, head, prev, &next_offset);
+            if (next_length >= 2 && next_length*8 - (8 + elias_gamma_bits((next_offset-1)/128+1) + elias_gamma_bits(next_length-1)) > match_gain + 9)
+                match_gain = 0;
+        }
+
+        if (last_gain > 0 && last_gain >= match_gain) {
+            length = last_length;
+            bits += 1 + elias_gamma_bits(literals) + literals*8 + 1 + elias_gamma_bits(length);
+            literals = 0;
+        } else if (match_gain > 0) {
+            length = best_length;
+            if (literals)
+                bits += 1 + elias_gamma_bits(literals) + literals*8;
+            bits += match_bits;
+            literals = 0;
+            last_offset = best_offset;
+        } else {
+            length = 1;
+            literals++;
+        }
+
+        for (i = 0; i < length; i++, index++)
+            greedy_insert(input_data, input_size, index, head, prev);
+    }
+    if (literals)
+        bits += 1 + elias_gamma_bits(literals) + literals*8;
+
+    literal_bits = elias_gamma_bits(input_size) + input_size*8;
+    if (bits > literal_bits)
+        bits = literal_bits;
+
+    free(head);
+    free(prev);
+    free(reversed_data);
+
+    return (bits+18+7)/8;
+}
+
+size_t zx0_decompress(unsigned char *in_data, size_t in_size, unsigned char *out_data, size_t out_capacity, bool backwards_mode) {
     int length;
     int i;
 
-    input_data = in_data;
+    /* a stream reading past in_size or writing past out_capacity returns ZX0_ERROR */
+    if (in_size == 0)
+        return ZX0_ERROR;
+
+    /* backwards streams are decoded forwards from a reversed copy */
+    if (backwards_mode) {
+        input_data = (unsigned char *)malloc(in_size);
+        if (!input_data) {
+             fprintf(stderr, "Error: Insufficient memory\n");
+             exit(1);
+        }
+        memcpy(input_data, in_data, in_size);
+        reverse(input_data, input_data+in_size-1);
+    } else {
+        input_data = in_data;
+    }
     output_data = out_data;
-    input_size = 0;
+    input_size = in_size;
     input_index = 0;
 
     output_index = 0;
     output_size = 0;
+    output_capacity = out_capacity;
+    data_error = FALSE;
     bit_mask = 0;
     backtrack = FALSE;
     last_offset = INITIAL_OFFSET;
 
 COPY_LITERALS:
-    length = read_interlaced_elias_gamma();
-    for (i = 0; i < length; i++) {
+    length = read_interlaced_elias_gamma(backwards_mode);
+    if (length > output_capacity-output_index)
+        data_error = TRUE;
+    for (i = 0; i < length && !data_error; i++) {
         write_byte(read_byte());
     }
     if (read_bit()) {
         goto COPY_FROM_NEW_OFFSET;
     }
+    if (data_error)
+        goto INVALID_DATA;
 
 /*COPY_FROM_LAST_OFFSET:*/
-    length = read_interlaced_elias_gamma();
+    length = read_interlaced_elias_gamma(backwards_mode);
     write_bytes(last_offset, length);
     if (!read_bit()) {
         goto COPY_LITERALS;
     }
 
 COPY_FROM_NEW_OFFSET:
-    last_offset = read_interlaced_elias_gamma();
+    if (data_error)
+        goto INVALID_DATA;
+    last_offset = read_interlaced_elias_gamma(backwards_mode);
+    if (data_error)
+        goto INVALID_DATA;
     if (last_offset == 256) {
-        return;
+        if (backwards_mode) {
+            free(input_data);
+            reverse(out_data, out_data+output_index-1);
+        }
+        return output_index;
     }
-    last_offset = ((last_offset-1)<<7)+128-(read_byte()>>1);
+    if (backwards_mode)
+        last_offset = ((last_offset-1)<<7)+(read_byte()>>1)+1;
+    else
+        last_offset = ((last_offset-1)<<7)+128-(read_byte()>>1);
     backtrack = TRUE;
-    length = read_interlaced_elias_gamma()+1;
+    length = read_interlaced_elias_gamma(backwards_mode)+1;
     write_bytes(last_offset, length);
+    if (data_error)
+        goto INVALID_DATA;
     if (read_bit()) {
         goto COPY_FROM_NEW_OFFSET;
     } else {
         goto COPY_LITERALS;
     }
+
+INVALID_DATA:
+    if (backwards_mode)
+        free(input_data);
+    return ZX0_ERROR;
 }
@@ -27,6 +27,7 @@
 #define _ZX0_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define FALSE 0
 #define TRUE 1
@@ -40,7 +41,13 @@
 
 #define QTY_BLOCKS 10000
 
+#define GREEDY_HASH_SIZE 65536
+#define GREEDY_HASH(data, index) ((data)[index]<<8|(data)[(index)+1])
+#define GREEDY_CHAIN_DEPTH 64
+
 #define BUFFER_SIZE 65536  /* must be > MAX_OFFSET */
+
+#define ZX0_ERROR ((size_t)-1)
 #define INITIAL_OFFSET 1
 
 typedef struct block_t {
@@ -60,6 +67,11 @@ void assign(BLOCK **ptr, BLOCK *chain);
 BLOCK *optimize(unsigned char *input_data, size_t input_size, int skip, int offset_limit);
 
 unsigned char *zx0_compress(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode, size_t *out_size);
-void zx0_decompress(unsigned char *in_data, unsigned char *out_data);
+size_t zx0_estimate(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode);
+size_t zx0_estimate_greedy(unsigned char *input_data, size_t input_size, bool quick_mode, bool backwards_mode);
+size_t zx0_decompress(unsigned char *in_data, size_t in_size, unsigned char *out_data, size_t out_capacity, bool backwards_mode);
+
+void zx0_set_progress(bool progress);
+void zx0_free_blocks(void);
 
 #endif
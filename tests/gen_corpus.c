@@ -0,0 +1,443 @@
+/*******************************************************************************
+ * Gfx2Next - Test corpus generator
+ *
+ * Writes a small, deterministic set of input images (and a Tiled map) that the
+ * golden-output tests run through gfx2next. The images are generated rather
+ * than checked in so the corpus is easy to review and extend.
+ *
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lodepng.h"
+
+#define NUM_PALETTE_COLORS			256
+
+static uint32_t m_seed = 0x12345678;
+
+static uint32_t next_random(uint32_t range)
+{
+	m_seed = m_seed * 1103515245 + 12345;
+	
+	return (m_seed >> 16) % range;
+}
+
+static void exit_with_msg(const char *msg, const char *filename)
+{
+	fprintf(stderr, msg, filename);
+	exit(EXIT_FAILURE);
+}
+
+static void get_palette_color(int i, uint8_t *r8, uint8_t *g8, uint8_t *b8)
+{
+	// Spectrum colors first so screen images can use indexes 0 to 15.
+	static const uint32_t screen_colors[16] =
+	{
+		0x000000, 0x0000D7, 0xD70000, 0xD700D7, 0x00D700, 0x00D7D7, 0xD7D700, 0xD7D7D7,
+		0x000000, 0x0000FF, 0xFF0000, 0xFF00FF, 0x00FF00, 0x00FFFF, 0xFFFF00, 0xFFFFFF
+	};
+	uint32_t rgb888 = (i < 16 ? screen_colors[i] : (uint32_t) (((i * 37) & 0xff) << 16 | ((i * 91) & 0xff) << 8 | ((i * 13) & 0xff)));
+	
+	*r8 = rgb888 >> 16;
+	*g8 = rgb888 >> 8;
+	*b8 = rgb888;
+}
+
+static void write_png(const char *filename, const uint8_t *image, int width, int height)
+{
+	unsigned char *png = NULL;
+	size_t png_size = 0;
+	LodePNGState state;
+	
+	lodepng_state_init(&state);
+	
+	for (int i = 0; i < NUM_PALETTE_COLORS; i++)
+	{
+		uint8_t r8, g8, b8;
+		
+		get_palette_color(i, &r8, &g8, &b8);
+		
+		lodepng_palette_add(&state.info_png.color, r8, g8, b8, 0xff);
+		lodepng_palette_add(&state.info_raw, r8, g8, b8, 0xff);
+	}
+	
+	state.info_png.color.colortype = LCT_PALETTE;
+	state.info_png.color.bitdepth = 8;
+	state.info_raw.colortype = LCT_PALETTE;
+	state.info_raw.bitdepth = 8;
+	state.encoder.auto_convert = 0;
+	
+	if (lodepng_encode(&png, &png_size, image, width, height, &state) || lodepng_save_file(png, png_size, filename))
+	{
+		exit_with_msg("Can't write %s.\n", filename);
+	}
+	
+	lodepng_state_cleanup(&state);
+	free(png);
+}
+
+static void write_le(FILE *p_file, uint32_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		fputc((value >> (i * 8)) & 0xff, p_file);
+}
+
+static void write_bmp_4bit(const char *filename, const uint8_t *image, int width, int height)
+{
+	int row_size = ((width + 1) / 2 + 3) & ~3;
+	int image_size = row_size * height;
+	FILE *p_file = fopen(filename, "wb");
+	
+	if (p_file == NULL)
+	{
+		exit_with_msg("Can't write %s.\n", filename);
+	}
+	
+	fputc('B', p_file);
+	fputc('M', p_file);
+	write_le(p_file, 14 + 40 + 16 * 4 + image_size, 4);
+	write_le(p_file, 0, 4);
+	write_le(p_file, 14 + 40 + 16 * 4, 4);
+	write_le(p_file, 40, 4);
+	write_le(p_file, width, 4);
+	write_le(p_file, height, 4);
+	write_le(p_file, 1, 2);
+	write_le(p_file, 4, 2);
+	write_le(p_file, 0, 4);
+	write_le(p_file, image_size, 4);
+	write_le(p_file, 2835, 4);
+	write_le(p_file, 2835, 4);
+	write_le(p_file, 16, 4);
+	write_le(p_file, 0, 4);
+	
+	for (int i = 0; i < 16; i++)
+	{
+		uint8_t r8, g8, b8;
+		
+		get_palette_color(i + 16, &r8, &g8, &b8);
+		
+		fputc(b8, p_file);
+		fputc(g8, p_file);
+		fputc(r8, p_file);
+		fputc(0, p_file);
+	}
+	
+	// Bottom to top rows.
+	for (int y = height - 1; y >= 0; y--)
+	{
+		for (int x = 0; x < row_size * 2; x += 2)
+		{
+			uint8_t left = (x < width ? image[y * width + x] & 0xf : 0);
+			uint8_t right = (x + 1 < width ? image[y * width + x + 1] & 0xf : 0);
+			
+			fputc((left << 4) | right, p_file);
+		}
+	}
+	
+	fclose(p_file);
+}
+
+// Fill a width x height image with tile_width x tile_height tiles picked from
+// tile_count random tiles, each placed with a random mirror/rotation.
+static uint8_t *create_tile_image(int width, int height, int tile_width, int tile_height, int tile_count, int color_count, int color_base)
+{
+	int tile_size = tile_width * tile_height;
+	uint8_t *tiles = malloc(tile_count * tile_size);
+	uint8_t *image = calloc(width * height, 1);
+	
+	for (int i = 0; i < tile_count * tile_size; i++)
+		tiles[i] = color_base + next_random(color_count);
+	
+	for (int ty = 0; ty < height / tile_height; ty++)
+	{
+		for (int tx = 0; tx < width / tile_width; tx++)
+		{
+			uint8_t *tile = &tiles[next_random(tile_count) * tile_size];
+			int orientation = (tile_width == tile_height ? next_random(8) : next_random(4));
+			
+			for (int y = 0; y < tile_height; y++)
+			{
+				for (int x = 0; x < tile_width; x++)
+				{
+					int sx = (orientation & 1 ? tile_width - 1 - x : x);
+					int sy = (orientation & 2 ? tile_height - 1 - y : y);
+					
+					if (orientation & 4)
+					{
+						int t = sx;
+						sx = sy;
+						sy = t;
+					}
+					
+					image[(ty * tile_height + y) * width + tx * tile_width + x] = tile[sy * tile_width + sx];
+				}
+			}
+		}
+	}
+	
+	free(tiles);
+	
+	return image;
+}
+
+static void write_tiles(const char *dir)
+{
+	char filename[512];
+	uint8_t *image = create_tile_image(128, 64, 8, 8, 12, 16, 16);
+	
+	snprintf(filename, sizeof(filename), "%s/tiles.png", dir);
+	write_png(filename, image, 128, 64);
+	
+	free(image);
+	
+	image = create_tile_image(64, 32, 8, 8, 6, 16, 0);
+	
+	snprintf(filename, sizeof(filename), "%s/tiles4.bmp", dir);
+	write_bmp_4bit(filename, image, 64, 32);
+	
+	free(image);
+}
+
+static void write_sprites(const char *dir)
+{
+	char filename[512];
+	uint8_t *image = create_tile_image(64, 64, 16, 16, 5, 16, 32);
+	
+	snprintf(filename, sizeof(filename), "%s/sprites.png", dir);
+	write_png(filename, image, 64, 64);
+	
+	free(image);
+}
+
+static void write_bitmap(const char *dir)
+{
+	char filename[512];
+	int width = 320, height = 256;
+	uint8_t *image = malloc(width * height);
+	
+	// Gradients with some noise so the bitmap compresses, but not trivially.
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			image[y * width + x] = (uint8_t) ((x / 10 + y / 8) & 0x7f) + (next_random(8) == 0 ? 0x80 : 0);
+		}
+	}
+	
+	snprintf(filename, sizeof(filename), "%s/bitmap.png", dir);
+	write_png(filename, image, width, height);
+	
+	free(image);
+}
+
+static void write_screen(const char *dir)
+{
+	char filename[512];
+	int width = 256, height = 192;
+	uint8_t *image = malloc(width * height);
+	
+	// Two Spectrum colors per 8x8 cell, ink pattern from a circle.
+	for (int cy = 0; cy < height / 8; cy++)
+	{
+		for (int cx = 0; cx < width / 8; cx++)
+		{
+			int bright = next_random(2) * 8;
+			uint8_t paper = bright + next_random(8);
+			uint8_t ink = bright + next_random(8);
+			
+			for (int y = 0; y < 8; y++)
+			{
+				for (int x = 0; x < 8; x++)
+				{
+					int px = cx * 8 + x - width / 2;
+					int py = cy * 8 + y - height / 2;
+					bool is_ink = ((px * px + py * py) / 97) & 1;
+					
+					image[(cy * 8 + y) * width + cx * 8 + x] = (is_ink ? ink : paper);
+				}
+			}
+		}
+	}
+	
+	snprintf(filename, sizeof(filename), "%s/screen.png", dir);
+	write_png(filename, image, width, height);
+	
+	// A 1-bit font of 16 characters.
+	width = 128;
+	height = 8;
+	
+	for (int i = 0; i < width * height; i++)
+		image[i] = (next_random(3) == 0 ? 15 : 0);
+	
+	snprintf(filename, sizeof(filename), "%s/font.png", dir);
+	write_png(filename, image, width, height);
+	
+	free(image);
+}
+
+static void write_base64(FILE *p_file, const uint8_t *p_data, size_t size)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	
+	for (size_t i = 0; i < size; i += 3)
+	{
+		uint32_t bits = (p_data[i] << 16) | (i + 1 < size ? p_data[i + 1] << 8 : 0) | (i + 2 < size ? p_data[i + 2] : 0);
+		
+		fputc(table[(bits >> 18) & 63], p_file);
+		fputc(table[(bits >> 12) & 63], p_file);
+		fputc(i + 1 < size ? table[(bits >> 6) & 63] : '=', p_file);
+		fputc(i + 2 < size ? table[bits & 63] : '=', p_file);
+	}
+}
+
+static void write_tmx(const char *dir, const char *name, const uint32_t *p_gids, int map_width, int map_height, bool zlib)
+{
+	char filename[512];
+	
+	snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+	FILE *p_file = fopen(filename, "w");
+	
+	if (p_file == NULL)
+	{
+		exit_with_msg("Can't write %s.\n", filename);
+	}
+	
+	fprintf(p_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(p_file, "<map version=\"1.5\" orientation=\"orthogonal\" renderorder=\"right-down\" width=\"%d\" height=\"%d\" tilewidth=\"8\" tileheight=\"8\" infinite=\"0\">\n", map_width, map_height);
+	fprintf(p_file, " <tileset firstgid=\"1\" name=\"tiles\" tilewidth=\"8\" tileheight=\"8\" tilecount=\"128\" columns=\"16\">\n");
+	fprintf(p_file, "  <image source=\"tiles.png\" width=\"128\" height=\"64\"/>\n");
+	fprintf(p_file, " </tileset>\n");
+	fprintf(p_file, " <layer id=\"1\" name=\"Tile Layer 1\" width=\"%d\" height=\"%d\">\n", map_width, map_height);
+	
+	if (zlib)
+	{
+		// Tiled's default layer format, little endian gids deflated and base64 encoded.
+		size_t raw_size = map_width * map_height * 4;
+		uint8_t *p_raw = malloc(raw_size);
+		unsigned char *p_compressed = NULL;
+		size_t compressed_size = 0;
+		
+		for (int i = 0; i < map_width * map_height; i++)
+		{
+			p_raw[i * 4 + 0] = p_gids[i] & 0xff;
+			p_raw[i * 4 + 1] = (p_gids[i] >> 8) & 0xff;
+			p_raw[i * 4 + 2] = (p_gids[i] >> 16) & 0xff;
+			p_raw[i * 4 + 3] = (p_gids[i] >> 24) & 0xff;
+		}
+		
+		if (lodepng_zlib_compress(&p_compressed, &compressed_size, p_raw, raw_size, &lodepng_default_compress_settings))
+		{
+			exit_with_msg("Can't compress %s.\n", filename);
+		}
+		
+		fprintf(p_file, "  <data encoding=\"base64\" compression=\"zlib\">\n   ");
+		write_base64(p_file, p_compressed, compressed_size);
+		fprintf(p_file, "\n  </data>\n");
+		
+		free(p_compressed);
+		free(p_raw);
+	}
+	else
+	{
+		fprintf(p_file, "  <data encoding=\"csv\">\n");
+		
+		for (int y = 0; y < map_height; y++)
+		{
+			for (int x = 0; x < map_width; x++)
+			{
+				fprintf(p_file, "%u%s", p_gids[y * map_width + x], (x == map_width - 1 && y == map_height - 1) ? "" : ",");
+			}
+			
+			fprintf(p_file, "\n");
+		}
+		
+		fprintf(p_file, "</data>\n");
+	}
+	
+	fprintf(p_file, " </layer>\n");
+	fprintf(p_file, "</map>\n");
+	
+	fclose(p_file);
+}
+
+static void write_infinite_tmx(const char *dir)
+{
+	// Two layers of 8x8 csv chunks scattered around the origin, with gaps.
+	static const int chunks[2][3][2] = { { { -8, -8 }, { 8, 0 }, { 0, 16 } }, { { 0, 0 }, { -16, 8 }, { 16, -8 } } };
+	char filename[512];
+	
+	snprintf(filename, sizeof(filename), "%s/map_infinite.tmx", dir);
+	FILE *p_file = fopen(filename, "w");
+	
+	if (p_file == NULL)
+	{
+		exit_with_msg("Can't write %s.\n", filename);
+	}
+	
+	fprintf(p_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(p_file, "<map version=\"1.5\" orientation=\"orthogonal\" renderorder=\"right-down\" width=\"40\" height=\"32\" tilewidth=\"8\" tileheight=\"8\" infinite=\"1\">\n");
+	fprintf(p_file, " <tileset firstgid=\"1\" name=\"tiles\" tilewidth=\"8\" tileheight=\"8\" tilecount=\"128\" columns=\"16\">\n");
+	fprintf(p_file, "  <image source=\"tiles.png\" width=\"128\" height=\"64\"/>\n");
+	fprintf(p_file, " </tileset>\n");
+	
+	for (int layer = 0; layer < 2; layer++)
+	{
+		fprintf(p_file, " <layer id=\"%d\" name=\"Layer %d\" width=\"40\" height=\"32\">\n", layer + 1, layer + 1);
+		fprintf(p_file, "  <data encoding=\"csv\">\n");
+		
+		for (int chunk = 0; chunk < 3; chunk++)
+		{
+			fprintf(p_file, "   <chunk x=\"%d\" y=\"%d\" width=\"8\" height=\"8\">\n", chunks[layer][chunk][0], chunks[layer][chunk][1]);
+			
+			for (int i = 0; i < 64; i++)
+				fprintf(p_file, "%u%s", next_random(13), (i == 63) ? "\n" : ",");
+			
+			fprintf(p_file, "</chunk>\n");
+		}
+		
+		fprintf(p_file, "  </data>\n");
+		fprintf(p_file, " </layer>\n");
+	}
+	
+	fprintf(p_file, "</map>\n");
+	
+	fclose(p_file);
+}
+
+static void write_maps(const char *dir)
+{
+	int map_width = 20, map_height = 12;
+	uint32_t gids[20 * 12];
+	
+	for (int i = 0; i < map_width * map_height; i++)
+	{
+		uint32_t gid = next_random(13);
+		uint32_t flags = (gid != 0 ? next_random(8) : 0);
+		
+		gids[i] = gid | (flags << 29);
+	}
+	
+	write_tmx(dir, "map.tmx", gids, map_width, map_height, false);
+	write_tmx(dir, "map_zlib.tmx", gids, map_width, map_height, true);
+	write_infinite_tmx(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: gen_corpus <dir>\n");
+		return EXIT_FAILURE;
+	}
+	
+	write_tiles(argv[1]);
+	write_sprites(argv[1]);
+	write_bitmap(argv[1]);
+	write_screen(argv[1]);
+	write_maps(argv[1]);
+	
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+# Runs a single golden-output case (see CMakeLists.txt).
+#
+# Inputs are copied into a clean work directory because gfx2next writes its
+# outputs next to the current directory. Every file that is not an input is
+# hashed and compared to the golden file.
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+foreach(input ${INPUTS})
+	file(COPY ${CORPUS_DIR}/${input} DESTINATION ${WORK_DIR})
+endforeach()
+
+execute_process(COMMAND ${GFX2NEXT} ${ARGS}
+	WORKING_DIRECTORY ${WORK_DIR}
+	RESULT_VARIABLE result
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE error)
+
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "gfx2next ${ARGS} failed (${result}):\n${output}\n${error}")
+endif()
+
+file(GLOB outputs RELATIVE ${WORK_DIR} ${WORK_DIR}/*)
+list(REMOVE_ITEM outputs ${INPUTS})
+list(SORT outputs)
+
+set(hashes "")
+
+foreach(output_file ${outputs})
+	file(SHA256 ${WORK_DIR}/${output_file} hash)
+	string(APPEND hashes "${hash}  ${output_file}\n")
+endforeach()
+
+if(UPDATE_GOLDEN)
+	file(WRITE ${GOLDEN_FILE} "${hashes}")
+	message(STATUS "Updated ${GOLDEN_FILE}")
+else()
+	if(NOT EXISTS ${GOLDEN_FILE})
+		message(FATAL_ERROR "Missing golden file ${GOLDEN_FILE}, run with -DGFX2NEXT_UPDATE_GOLDEN=ON")
+	endif()
+
+	file(READ ${GOLDEN_FILE} expected)
+
+	if(NOT hashes STREQUAL expected)
+		message(FATAL_ERROR "Output of ${CASE} differs from golden.\nExpected:\n${expected}\nActual:\n${hashes}")
+	endif()
+endif()
+
@@ -0,0 +1,67 @@
+# Times a single case (see CMakeLists.txt) against a stored baseline.
+#
+# The case is run RUNS times in its own work directory and the median of the
+# total_ms reported by -stats=json is compared to BASELINE_FILE. The baseline
+# is only written when UPDATE_BASELINE is set, so it stays the time of the
+# build it was recorded with until someone records it again.
+
+set(times "")
+
+foreach(run RANGE 1 ${RUNS})
+	file(REMOVE_RECURSE ${WORK_DIR})
+	file(MAKE_DIRECTORY ${WORK_DIR})
+
+	foreach(input ${INPUTS})
+		file(COPY ${CORPUS_DIR}/${input} DESTINATION ${WORK_DIR})
+	endforeach()
+
+	execute_process(COMMAND ${GFX2NEXT} ${ARGS} -stats=json
+		WORKING_DIRECTORY ${WORK_DIR}
+		RESULT_VARIABLE result
+		OUTPUT_VARIABLE output
+		ERROR_VARIABLE error)
+
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "gfx2next ${ARGS} failed (${result}):\n${output}\n${error}")
+	endif()
+
+	if(NOT output MATCHES "\"total_ms\": ([0-9]+)\\.")
+		message(FATAL_ERROR "No -stats=json output from gfx2next:\n${output}")
+	endif()
+
+	# Zero padded so the string sort below is numeric.
+	set(time_ms "${CMAKE_MATCH_1}")
+	string(LENGTH "${time_ms}" length)
+
+	while(length LESS 10)
+		set(time_ms "0${time_ms}")
+		math(EXPR length "${length} + 1")
+	endwhile()
+
+	list(APPEND times "${time_ms}")
+endforeach()
+
+list(SORT times)
+list(LENGTH times count)
+math(EXPR middle "${count} / 2")
+list(GET times ${middle} median_ms)
+math(EXPR median_ms "${median_ms} + 0")
+
+if(UPDATE_BASELINE)
+	file(WRITE ${BASELINE_FILE} "${median_ms}\n")
+	message(STATUS "${CASE}: recorded baseline of ${median_ms} ms in ${BASELINE_FILE}")
+else()
+	if(NOT EXISTS ${BASELINE_FILE})
+		message(FATAL_ERROR "Missing baseline ${BASELINE_FILE}, record one with -DGFX2NEXT_UPDATE_PERF_BASELINE=ON")
+	endif()
+
+	file(READ ${BASELINE_FILE} baseline_ms)
+	string(STRIP "${baseline_ms}" baseline_ms)
+	math(EXPR limit_ms "${baseline_ms} * ${PERF_THRESHOLD} / 100 + ${PERF_SLACK_MS}")
+
+	if(median_ms GREATER limit_ms)
+		message(FATAL_ERROR "${CASE} took ${median_ms} ms (median of ${count}), baseline ${baseline_ms} ms (limit ${limit_ms} ms).")
+	endif()
+
+	message(STATUS "${CASE}: ${median_ms} ms (median of ${count}), baseline ${baseline_ms} ms")
+endif()